@@ -3,6 +3,12 @@
 
 int main(void)
 {
+    int r;
+
     vmem_bootstrap();
-    return vmem_run_tests();
+
+    r = vmem_run_tests();
+    r |= vmem_run_cpp_tests();
+
+    return r;
 }
@@ -6,11 +6,13 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <vmem.h>
 /* clang-format on */
 
 #define VMEM_ADDR_MIN (void *)0
 #define VMEM_ADDR_MAX (void *)(~(uintptr_t)0)
+#define ARR_SIZE(x) (sizeof(x) / sizeof(*x))
 
 /* We cannot use cmocka's state since it requires C99 */
 static Vmem vmem_va;
@@ -26,6 +28,14 @@ static void internal_freewired(Vmem *vmem, void *ptr, size_t size)
     vmem_free(vmem, ptr, size);
 }
 
+static int nimports;
+
+static void *internal_xallocwired(Vmem *vmem, size_t size, size_t align, size_t phase, size_t nocross, void *minaddr, void *maxaddr, int vmflag)
+{
+    nimports++;
+    return vmem_xalloc(vmem, size, align, phase, nocross, minaddr, maxaddr, vmflag);
+}
+
 static void test_vmem_alloc(void **state)
 {
     int prev_in_use = vmem_va.stat.in_use;
@@ -92,6 +102,572 @@ static void test_vmem_imported(void **state)
     vmem_free(&vmem_wired, ret2, 0x1000);
 }
 
+static void test_vmem_free_deferred(void **state)
+{
+    size_t prev_in_use = vmem_va.stat.in_use;
+    void *ptr1 = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+    void *ptr2 = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+    void *ret;
+
+    (void)state;
+
+    assert_int_equal(vmem_free_deferred(&vmem_va, ptr2, 0x1000), 0);
+    assert_int_equal(vmem_free_deferred(&vmem_va, ptr1, 0x1000), 0);
+
+    /* Nothing is returned to the arena until the next allocation */
+    assert_int_equal(vmem_va.stat.deferred, 0x2000);
+    assert_int_equal(vmem_va.stat.in_use, prev_in_use + 0x2000);
+
+    ret = vmem_alloc(&vmem_va, 0x2000, VM_INSTANTFIT);
+
+    /* Both pending frees were coalesced back into the start of the span */
+    assert_ptr_equal(ret, ptr1);
+    assert_int_equal(vmem_va.stat.deferred, 0);
+    assert_int_equal(vmem_va.stat.in_use, prev_in_use + 0x2000);
+
+    vmem_free(&vmem_va, ret, 0x2000);
+}
+
+static void test_vmem_free_deferred_drain(void **state)
+{
+    size_t prev_in_use = vmem_va.stat.in_use;
+    void *ptrs[VMEM_DEFERRED_N / 2 + 2];
+    size_t i;
+
+    (void)state;
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+        ptrs[i] = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+
+    for (i = 0; i < VMEM_DEFERRED_N / 2 - 1; i++)
+        assert_int_equal(vmem_free_deferred(&vmem_va, ptrs[i], 0x1000), 0);
+
+    /* Below the threshold, frees from the owner leave the queue alone */
+    vmem_free(&vmem_va, ptrs[ARR_SIZE(ptrs) - 1], 0x1000);
+    assert_int_equal(vmem_va.stat.deferred, (VMEM_DEFERRED_N / 2 - 1) * 0x1000);
+
+    /* Once half the queue is pending, the next free drains it without waiting for an allocation */
+    assert_int_equal(vmem_free_deferred(&vmem_va, ptrs[i], 0x1000), 0);
+    vmem_free(&vmem_va, ptrs[ARR_SIZE(ptrs) - 2], 0x1000);
+
+    assert_int_equal(vmem_va.stat.deferred, 0);
+    assert_int_equal(vmem_va.stat.in_use, prev_in_use);
+}
+
+#define DEFERRED_THREADS 4
+#define DEFERRED_FREES 500
+
+static Vmem vmem_shared;
+static void *deferred_ptrs[DEFERRED_THREADS][DEFERRED_FREES];
+static size_t deferred_done;
+
+static void *deferred_producer(void *arg)
+{
+    void **ptrs = arg;
+    size_t i;
+
+    for (i = 0; i < DEFERRED_FREES; i++)
+    {
+        /* The queue is full until the owning thread allocates or frees */
+        while (vmem_free_deferred(&vmem_shared, ptrs[i], 0x1000) != 0)
+            ;
+
+        __atomic_add_fetch(&deferred_done, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void test_vmem_free_deferred_threads(void **state)
+{
+    pthread_t threads[DEFERRED_THREADS];
+    void *ret;
+    size_t i, j;
+
+    (void)state;
+
+    vmem_init(&vmem_shared, "tests-shared", (void *)0x100000, 0x1000000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < DEFERRED_THREADS; i++)
+        for (j = 0; j < DEFERRED_FREES; j++)
+            deferred_ptrs[i][j] = vmem_alloc(&vmem_shared, 0x1000, VM_INSTANTFIT);
+
+    deferred_done = 0;
+
+    for (i = 0; i < DEFERRED_THREADS; i++)
+        pthread_create(&threads[i], NULL, deferred_producer, deferred_ptrs[i]);
+
+    /* Keep allocating while the producers free, each allocation drains the queue */
+    while (__atomic_load_n(&deferred_done, __ATOMIC_ACQUIRE) < DEFERRED_THREADS * DEFERRED_FREES)
+    {
+        ret = vmem_alloc(&vmem_shared, 0x1000, VM_INSTANTFIT);
+        vmem_free(&vmem_shared, ret, 0x1000);
+    }
+
+    for (i = 0; i < DEFERRED_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    ret = vmem_alloc(&vmem_shared, 0x1000, VM_INSTANTFIT);
+    vmem_free(&vmem_shared, ret, 0x1000);
+
+    assert_int_equal(vmem_shared.stat.deferred, 0);
+    assert_int_equal(vmem_shared.stat.in_use, 0);
+
+    /* Everything coalesced back into the initial span */
+    assert_ptr_equal(vmem_alloc(&vmem_shared, 0x1000000, VM_INSTANTFIT), (void *)0x100000);
+
+    vmem_destroy(&vmem_shared);
+}
+
+static int import_limit;
+
+static void *internal_alloclimited(Vmem *vmem, size_t size, int vmflag)
+{
+    if (nimports >= import_limit)
+        return NULL;
+
+    nimports++;
+    return vmem_alloc(vmem, size, vmflag);
+}
+
+static void test_vmem_alloc_sg(void **state)
+{
+    static Vmem vmem_parent, vmem_child;
+    void *ptrs[4];
+    VmemRange vec[4];
+    size_t prev_in_use;
+    int n;
+
+    (void)state;
+
+    /* The child owns a span of its own and imports from the parent when its free segments aren't enough */
+    vmem_init(&vmem_parent, "tests-sg-parent", (void *)0x100000, 0x8000, 0x1000, NULL, NULL, NULL, 0, 0);
+    vmem_init(&vmem_child, "tests-sg-child", 0, 0, 0x1000, internal_alloclimited, internal_freewired, &vmem_parent, 0, 0);
+    vmem_add(&vmem_child, (void *)0x10000, 0x4000, 0);
+
+    ptrs[0] = vmem_alloc(&vmem_child, 0x1000, VM_INSTANTFIT);
+    ptrs[1] = vmem_alloc(&vmem_child, 0x1000, VM_INSTANTFIT);
+    ptrs[2] = vmem_alloc(&vmem_child, 0x1000, VM_INSTANTFIT);
+    ptrs[3] = vmem_alloc(&vmem_child, 0x1000, VM_INSTANTFIT);
+
+    /* Leave two single page holes */
+    vmem_free(&vmem_child, ptrs[0], 0x1000);
+    vmem_free(&vmem_child, ptrs[2], 0x1000);
+
+    /* With two entries, the last one must cover the 0x2000 left after the first hole: the other hole is skipped and
+     * the missing part is imported in one piece */
+    nimports = 0;
+    import_limit = 1;
+
+    n = vmem_alloc_sg(&vmem_child, 0x3000, 0x1000, vec, 2, VM_INSTANTFIT);
+
+    assert_int_equal(n, 2);
+    assert_int_equal(vec[0].size, 0x1000);
+    assert_ptr_equal(vec[1].base, (void *)0x100000);
+    assert_int_equal(vec[1].size, 0x2000);
+    assert_int_equal(nimports, 1);
+    assert_int_equal(vmem_parent.stat.in_use, 0x2000);
+
+    /* An empty request takes nothing */
+    assert_int_equal(vmem_alloc_sg(&vmem_child, 0, 0x1000, vec + 2, 2, VM_INSTANTFIT), 0);
+
+    /* The last hole isn't enough and the source refuses to import: what was taken is given back */
+    prev_in_use = vmem_child.stat.in_use;
+
+    assert_int_equal(vmem_alloc_sg(&vmem_child, 0x2000, 0x1000, vec + 2, 2, VM_INSTANTFIT), -VMEM_ERR_NO_MEM);
+    assert_int_equal(vmem_child.stat.in_use, prev_in_use);
+    assert_int_equal(vmem_parent.stat.in_use, 0x2000);
+
+    /* The hole is still there */
+    assert_int_equal(vmem_alloc_sg(&vmem_child, 0x1000, 0x1000, vec + 2, 1, VM_INSTANTFIT), 1);
+    vmem_free_sg(&vmem_child, vec + 2, 1);
+
+    /* Freeing the ranges gives the imported span back to the parent */
+    vmem_free_sg(&vmem_child, vec, n);
+    assert_int_equal(vmem_parent.stat.in_use, 0);
+
+    vmem_free(&vmem_child, ptrs[1], 0x1000);
+    vmem_free(&vmem_child, ptrs[3], 0x1000);
+
+    assert_int_equal(vmem_child.stat.in_use, 0);
+
+    vmem_destroy(&vmem_child);
+    vmem_destroy(&vmem_parent);
+}
+
+static void test_vmem_topdown(void **state)
+{
+    static Vmem vmem_life;
+    void *high = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT | VM_LONGLIVED);
+    void *low = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT | VM_SHORTLIVED);
+    void *ptrs[8];
+    void *ret;
+    int i, k;
+
+    (void)state;
+
+    /* Long-lived allocations go to the top of the span, short-lived ones to the bottom */
+    assert_ptr_equal(high, (void *)0x100000);
+    assert_ptr_equal(low, (void *)0x1000);
+
+    vmem_free(&vmem_va, high, 0x1000);
+    vmem_free(&vmem_va, low, 0x1000);
+
+    /* Holes left among short-lived allocations don't attract long-lived ones, with the address tree (arena created with a
+     * placement hint) and with the freelist scan */
+    for (k = 0; k < 2; k++)
+    {
+        vmem_init(&vmem_life, "tests-life", (void *)0x10000, 0x100000, 0x1000, NULL, NULL, NULL, 0, k == 0 ? VM_LONGLIVED : 0);
+
+        for (i = 0; i < 8; i++)
+            ptrs[i] = vmem_alloc(&vmem_life, 0x1000, VM_INSTANTFIT | VM_SHORTLIVED);
+
+        assert_ptr_equal(ptrs[7], (void *)0x17000);
+
+        vmem_free(&vmem_life, ptrs[3], 0x1000);
+
+        ret = vmem_alloc(&vmem_life, 0x1000, VM_INSTANTFIT | VM_LONGLIVED);
+        assert_ptr_equal(ret, (void *)0x10f000);
+
+        /* The next short-lived allocation fills the lowest hole */
+        assert_ptr_equal(vmem_alloc(&vmem_life, 0x1000, VM_INSTANTFIT | VM_SHORTLIVED), ptrs[3]);
+
+        /* Aligned top-down allocations stay at the top too */
+        ret = vmem_xalloc(&vmem_life, 0x1000, 0x10000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_TOPDOWN);
+        assert_ptr_equal(ret, (void *)0x100000);
+
+        /* Only arenas created with a placement hint pay for the address tree */
+        if (k == 0)
+            assert_ptr_not_equal(vmem_life.addrtree, NULL);
+        else
+            assert_ptr_equal(vmem_life.addrtree, NULL);
+
+        vmem_destroy(&vmem_life);
+    }
+}
+
+static void test_vmem_import_constrained(void **state)
+{
+    static Vmem vmem_child;
+    void *ret;
+
+    (void)state;
+
+    vmem_xinit(&vmem_child, "tests-child", 0, 0, 0x1000, internal_xallocwired, internal_freewired, &vmem_va, 0, 0);
+
+    nimports = 0;
+    ret = vmem_xalloc(&vmem_child, 0x1000, 0x10000, 0x2000, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+
+    /* The constraint was forwarded to the parent, so a single import was enough */
+    assert_int_equal(nimports, 1);
+    assert_int_equal((uintptr_t)ret % 0x10000, 0x2000);
+
+    vmem_xfree(&vmem_child, ret, 0x1000);
+
+    /* The span went back to the parent */
+    assert_int_equal(vmem_va.stat.in_use, 0);
+
+    /* A non power of two span lands in a freelist instant-fit skips, it must still be used right away */
+    nimports = 0;
+    ret = vmem_xalloc(&vmem_child, 0x3000, 0x10000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+
+    assert_int_equal(nimports, 1);
+    assert_int_equal((uintptr_t)ret % 0x10000, 0);
+
+    vmem_xfree(&vmem_child, ret, 0x3000);
+
+    nimports = 0;
+    ret = vmem_xalloc(&vmem_child, 0x3000, 0, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+
+    assert_int_equal(nimports, 1);
+    assert_ptr_not_equal(ret, NULL);
+
+    vmem_xfree(&vmem_child, ret, 0x3000);
+
+    assert_int_equal(vmem_va.stat.in_use, 0);
+
+    vmem_destroy(&vmem_child);
+}
+
+static void test_vmem_reset(void **state)
+{
+    static Vmem vmem_req, vmem_child;
+    size_t prev_in_use = vmem_va.stat.in_use;
+    int i;
+
+    (void)state;
+
+    vmem_init(&vmem_req, "tests-reset", (void *)0x10000, 0x10000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < 8; i++)
+        vmem_alloc(&vmem_req, 0x1000, VM_INSTANTFIT);
+
+    vmem_reset(&vmem_req);
+
+    /* Everything is free again and the span is in a single piece */
+    assert_int_equal(vmem_req.stat.in_use, 0);
+    assert_int_equal(vmem_req.nsegs, 2);
+    assert_ptr_equal(vmem_alloc(&vmem_req, 0x10000, VM_INSTANTFIT), (void *)0x10000);
+
+    vmem_destroy(&vmem_req);
+
+    /* Destroying an arena with live allocations gives its imported spans back */
+    vmem_init(&vmem_child, "tests-reset-child", 0, 0, 0x1000, internal_allocwired, internal_freewired, &vmem_va, 0, 0);
+
+    for (i = 0; i < 4; i++)
+        vmem_alloc(&vmem_child, 0x1000, VM_INSTANTFIT);
+
+    assert_int_equal(vmem_va.stat.in_use, prev_in_use + 0x4000);
+
+    vmem_destroy(&vmem_child);
+
+    assert_int_equal(vmem_va.stat.in_use, prev_in_use);
+}
+
+static void test_vmem_add_bulk(void **state)
+{
+    static Vmem vmem_map;
+    VmemRange ranges[] = {
+        {(void *)0x30000, 0x1000},
+        {(void *)0x11000, 0x2000},
+        {(void *)0x50000, 0},
+        {(void *)0x10000, 0x1000},
+        {(void *)0x13000, 0x1000},
+    };
+    VmemRange more[] = {
+        {(void *)0x31000, 0x1000},
+        {(void *)0x2f000, 0x1000},
+    };
+    VmemRange gap[] = {
+        {(void *)0x14000, 0x1b000},
+    };
+    VmemRange overlap[] = {
+        {(void *)0x14000, 0x1000},
+        {(void *)0x2e000, 0x2000},
+    };
+    VmemRange dup[] = {
+        {(void *)0x40000, 0x1000},
+        {(void *)0x40000, 0x1000},
+    };
+    void *ret;
+
+    (void)state;
+
+    vmem_init(&vmem_map, "tests-bulk", 0, 0, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    assert_int_equal(vmem_add_bulk(&vmem_map, ranges, ARR_SIZE(ranges), 0), 0);
+
+    /* The three back to back ranges end up in a single span */
+    assert_int_equal(vmem_map.nsegs, 4);
+
+    ret = vmem_alloc(&vmem_map, 0x4000, VM_INSTANTFIT);
+    assert_ptr_equal(ret, (void *)0x10000);
+    vmem_free(&vmem_map, ret, 0x4000);
+
+    /* Both new ranges are fused with the existing span at 0x30000 */
+    assert_int_equal(vmem_add_bulk(&vmem_map, more, ARR_SIZE(more), VM_FUSE), 0);
+    assert_int_equal(vmem_map.nsegs, 4);
+
+    ret = vmem_alloc(&vmem_map, 0x3000, VM_BESTFIT);
+    assert_ptr_equal(ret, (void *)0x2f000);
+    vmem_free(&vmem_map, ret, 0x3000);
+
+    assert_int_equal(vmem_map.stat.total, 0x7000);
+
+    /* Overlapping or duplicate ranges are rejected before anything is added */
+    assert_int_equal(vmem_add_bulk(&vmem_map, overlap, ARR_SIZE(overlap), VM_FUSE), -VMEM_ERR_OVERLAP);
+    assert_int_equal(vmem_add_bulk(&vmem_map, dup, ARR_SIZE(dup), 0), -VMEM_ERR_OVERLAP);
+    assert_int_equal(vmem_map.stat.total, 0x7000);
+    assert_int_equal(vmem_map.nsegs, 4);
+
+    /* Filling the gap fuses the spans on both sides into one */
+    assert_int_equal(vmem_add_bulk(&vmem_map, gap, ARR_SIZE(gap), VM_FUSE), 0);
+    assert_int_equal(vmem_map.nsegs, 2);
+
+    ret = vmem_alloc(&vmem_map, 0x22000, VM_BESTFIT);
+    assert_ptr_equal(ret, (void *)0x10000);
+    vmem_free(&vmem_map, ret, 0x22000);
+
+    vmem_destroy(&vmem_map);
+}
+
+static void test_vmem_bestfit(void **state)
+{
+    static Vmem vmem_ids;
+    void *ptrs[8];
+    void *ret;
+    int i, k;
+
+    (void)state;
+
+    /* Same answers with the size tree (arena created with VM_BESTFIT) and with the freelist scan */
+    for (k = 0; k < 2; k++)
+    {
+        vmem_init(&vmem_ids, "tests-bestfit", (void *)0x1000, 0x8000, 0x1000, NULL, NULL, NULL, 0, k == 0 ? VM_BESTFIT : 0);
+
+        for (i = 0; i < 8; i++)
+            ptrs[i] = vmem_alloc(&vmem_ids, 0x1000, VM_INSTANTFIT);
+
+        /* Free holes of 2, 1 and 1 pages, in that order */
+        vmem_free(&vmem_ids, ptrs[0], 0x1000);
+        vmem_free(&vmem_ids, ptrs[1], 0x1000);
+        vmem_free(&vmem_ids, ptrs[6], 0x1000);
+        vmem_free(&vmem_ids, ptrs[4], 0x1000);
+
+        /* The smallest hole wins, the lowest one on ties */
+        ret = vmem_alloc(&vmem_ids, 0x1000, VM_BESTFIT);
+        assert_ptr_equal(ret, ptrs[4]);
+
+        ret = vmem_alloc(&vmem_ids, 0x1000, VM_BESTFIT);
+        assert_ptr_equal(ret, ptrs[6]);
+
+        ret = vmem_alloc(&vmem_ids, 0x1000, VM_BESTFIT);
+        assert_ptr_equal(ret, ptrs[0]);
+
+        /* Alignment rules out the hole at 0x2000 and leaves the one at 0x4000 */
+        vmem_free(&vmem_ids, ptrs[3], 0x1000);
+
+        ret = vmem_xalloc(&vmem_ids, 0x1000, 0x4000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_BESTFIT);
+        assert_ptr_equal(ret, ptrs[3]);
+
+        /* Only arenas created with VM_BESTFIT pay for the size tree */
+        if (k == 0)
+            assert_ptr_not_equal(vmem_ids.sizetree, NULL);
+        else
+            assert_ptr_equal(vmem_ids.sizetree, NULL);
+
+        vmem_destroy(&vmem_ids);
+    }
+}
+
+static void test_vmem_bestfit_aligned(void **state)
+{
+    static Vmem vmem_vec;
+    void *ret;
+    size_t i;
+
+    (void)state;
+
+    vmem_init(&vmem_vec, "tests-bestfit-aligned", (void *)0x100000, 0x100000, 0x1000, NULL, NULL, NULL, 0, VM_BESTFIT);
+
+    for (i = 0; i < 0x100; i++)
+        vmem_alloc(&vmem_vec, 0x1000, VM_INSTANTFIT);
+
+    /* Misaligned single pages come first in the size tree, then an aligned one, then a region with room for any alignment */
+    for (i = 0; i < 5; i++)
+        vmem_free(&vmem_vec, (void *)(0x101000 + i * 0x2000), 0x1000);
+
+    vmem_free(&vmem_vec, (void *)0x1a0000, 0x1000);
+
+    for (i = 0; i < 0x20; i++)
+        vmem_free(&vmem_vec, (void *)(0x1c0000 + i * 0x1000), 0x1000);
+
+    /* After VMEM_BESTFIT_PROBES misses the search stops probing single pages and takes the region */
+    ret = vmem_xalloc(&vmem_vec, 0x1000, 0x10000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_BESTFIT);
+    assert_ptr_equal(ret, (void *)0x1c0000);
+
+    vmem_destroy(&vmem_vec);
+}
+
+static size_t relocated;
+
+static int internal_relocate(void *arg, void *from, void *to, size_t size)
+{
+    (void)arg;
+    (void)from;
+    (void)to;
+
+    relocated += size;
+    return 0;
+}
+
+static void test_vmem_compact(void **state)
+{
+    static Vmem vmem_frag;
+    void *ptrs[4];
+
+    (void)state;
+
+    vmem_init(&vmem_frag, "tests-compact", (void *)0x10000, 0x4000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    ptrs[0] = vmem_alloc(&vmem_frag, 0x1000, VM_INSTANTFIT);
+    ptrs[1] = vmem_alloc(&vmem_frag, 0x1000, VM_INSTANTFIT);
+    ptrs[2] = vmem_alloc(&vmem_frag, 0x1000, VM_INSTANTFIT);
+    ptrs[3] = vmem_alloc(&vmem_frag, 0x1000, VM_INSTANTFIT);
+
+    vmem_free(&vmem_frag, ptrs[0], 0x1000);
+    vmem_free(&vmem_frag, ptrs[2], 0x1000);
+
+    /* The budget only allows a single move, which must be the one merging both holes */
+    relocated = 0;
+    assert_int_equal(vmem_compact(&vmem_frag, internal_relocate, NULL, 0x1000), 0x1000);
+    assert_int_equal(relocated, 0x1000);
+
+    assert_int_equal(vmem_compact(&vmem_frag, internal_relocate, NULL, 0x1000), 0x1000);
+    assert_int_equal(vmem_compact(&vmem_frag, internal_relocate, NULL, 0x1000), 0);
+
+    /* Both allocations now sit at the bottom of the span */
+    ptrs[0] = vmem_alloc(&vmem_frag, 0x2000, VM_INSTANTFIT);
+    assert_ptr_equal(ptrs[0], (void *)0x12000);
+
+    vmem_free(&vmem_frag, ptrs[0], 0x2000);
+    vmem_free(&vmem_frag, (void *)0x10000, 0x1000);
+    vmem_free(&vmem_frag, (void *)0x11000, 0x1000);
+
+    /* A segment allocated with a phase stays where it is, even with a free segment right before it */
+    ptrs[0] = vmem_xalloc(&vmem_frag, 0x1000, 0x2000, 0x1000, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+    assert_ptr_equal(ptrs[0], (void *)0x11000);
+
+    assert_int_equal(vmem_compact(&vmem_frag, internal_relocate, NULL, 0x4000), 0);
+
+    vmem_xfree(&vmem_frag, ptrs[0], 0x1000);
+
+    vmem_destroy(&vmem_frag);
+}
+
+static void test_vmem_compact_window(void **state)
+{
+    static Vmem vmem_big;
+    void *top, *ret;
+    size_t i, calls = 0;
+
+    (void)state;
+
+    vmem_init(&vmem_big, "tests-compact-window", (void *)0x100000, 0x100000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    top = vmem_alloc(&vmem_big, 0x1000, VM_INSTANTFIT | VM_LONGLIVED);
+    assert_ptr_equal(top, (void *)0x1ff000);
+
+    /* 64 holes between 64 allocations, many more segments than a single call looks at */
+    for (i = 0; i < 128; i++)
+        vmem_alloc(&vmem_big, 0x1000, VM_INSTANTFIT | VM_SHORTLIVED);
+
+    for (i = 0; i < 128; i += 2)
+        vmem_free(&vmem_big, (void *)(0x100000 + i * 0x1000), 0x1000);
+
+    /* Even with an unlimited budget, a call stops at the end of its window */
+    relocated = 0;
+    vmem_compact(&vmem_big, internal_relocate, NULL, (size_t)-1);
+    assert_true(relocated > 0 && relocated < 64 * 0x1000);
+
+    while (vmem_big.compact_idle < vmem_big.nsegs)
+    {
+        vmem_compact(&vmem_big, internal_relocate, NULL, (size_t)-1);
+        calls++;
+    }
+
+    assert_true(calls > 1);
+
+    /* The short-lived allocations are packed at the bottom, the long-lived one didn't move */
+    ret = vmem_alloc(&vmem_big, 0xbf000, VM_BESTFIT);
+    assert_ptr_equal(ret, (void *)0x140000);
+
+    vmem_free(&vmem_big, ret, 0xbf000);
+    vmem_free(&vmem_big, top, 0x1000);
+
+    vmem_destroy(&vmem_big);
+}
+
 int vmem_run_tests(void)
 {
     int r;
@@ -100,6 +676,18 @@ int vmem_run_tests(void)
         cmocka_unit_test(test_vmem_free),
         cmocka_unit_test(test_vmem_free_coalesce),
         cmocka_unit_test(test_vmem_imported),
+        cmocka_unit_test(test_vmem_free_deferred),
+        cmocka_unit_test(test_vmem_free_deferred_drain),
+        cmocka_unit_test(test_vmem_free_deferred_threads),
+        cmocka_unit_test(test_vmem_alloc_sg),
+        cmocka_unit_test(test_vmem_topdown),
+        cmocka_unit_test(test_vmem_compact),
+        cmocka_unit_test(test_vmem_compact_window),
+        cmocka_unit_test(test_vmem_import_constrained),
+        cmocka_unit_test(test_vmem_reset),
+        cmocka_unit_test(test_vmem_add_bulk),
+        cmocka_unit_test(test_vmem_bestfit),
+        cmocka_unit_test(test_vmem_bestfit_aligned),
     };
 
     vmem_init(&vmem_va, "tests-va", (void *)0x1000, 0x100000, 0x1000, NULL, NULL, NULL, 0, 0);
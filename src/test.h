@@ -1,6 +1,18 @@
 #ifndef _VMEM_TEST_H
 #define _VMEM_TEST_H
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 int vmem_run_tests(void);
 
+/* Tests for the C++ layer (vmem.hpp), in test_cpp.cpp */
+int vmem_run_cpp_tests(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
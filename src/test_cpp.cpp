@@ -0,0 +1,94 @@
+/* clang-format off */
+#include <cstdint>
+#include <cstddef>
+#include <cstdarg>
+#include <csetjmp>
+#include <utility>
+#include <vector>
+#include <cmocka.h>
+#include <test.h>
+#include <vmem.hpp>
+/* clang-format on */
+
+/* The C++ layer writes to what it allocates (pmr containers, monotonic chunk headers), so arenas manage real memory here */
+alignas(0x1000) static unsigned char heap[0x100000];
+
+static void test_cpp_memory_resource(void **state)
+{
+    tinyvmem::arena a("tests-cpp", heap, sizeof(heap), 0x1000);
+    tinyvmem::memory_resource mr(a);
+    void *ptr;
+
+    (void)state;
+
+    {
+        std::pmr::vector<int> v(&mr);
+
+        for (int i = 0; i < 10000; i++)
+            v.push_back(i);
+
+        assert_int_equal(v[9999], 9999);
+        assert_true(a.get()->stat.in_use > 0);
+    }
+
+    /* Alignments above the quantum are forwarded to vmem_xalloc() */
+    ptr = mr.allocate(100, 0x4000);
+    assert_int_equal(reinterpret_cast<uintptr_t>(ptr) % 0x4000, 0);
+    mr.deallocate(ptr, 100, 0x4000);
+
+    assert_int_equal(a.get()->stat.in_use, 0);
+}
+
+static void test_cpp_allocation(void **state)
+{
+    tinyvmem::arena a("tests-cpp", heap, sizeof(heap), 0x1000);
+
+    (void)state;
+
+    {
+        tinyvmem::allocation<int> h = a.allocate<int>(10);
+        tinyvmem::allocation<int> moved;
+
+        assert_true(static_cast<bool>(h));
+        assert_int_equal(h.size(), 0x1000);
+
+        /* Ownership follows the handle, the resource is given back once */
+        moved = std::move(h);
+        assert_false(static_cast<bool>(h));
+        assert_int_equal(a.get()->stat.in_use, 0x1000);
+    }
+
+    assert_int_equal(a.get()->stat.in_use, 0);
+}
+
+static void test_cpp_monotonic_release(void **state)
+{
+    tinyvmem::arena parent("tests-cpp", heap, sizeof(heap), 0x1000);
+    tinyvmem::monotonic_arena m(parent, 0x2000);
+
+    (void)state;
+
+    {
+        std::pmr::vector<long> v(&m);
+
+        for (int i = 0; i < 5000; i++)
+            v.push_back(i);
+
+        assert_true(parent.get()->stat.in_use > 0);
+    }
+
+    /* Deallocation is a no-op, every chunk goes back at once */
+    m.release();
+    assert_int_equal(parent.get()->stat.in_use, 0);
+}
+
+int vmem_run_cpp_tests(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_cpp_memory_resource),
+        cmocka_unit_test(test_cpp_allocation),
+        cmocka_unit_test(test_cpp_monotonic_release),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -16,13 +16,42 @@
 #    include <stdlib.h>
 #    define vmem_printf printf
 #    define ASSERT assert
-#    define vmem_alloc_pages(x) malloc(x * 4096)
+#    define vmem_alloc_pages(x) malloc(x * VMEM_PAGE_SIZE)
+#endif
+
+/* Best-fit candidates ruled out by alignment before the size tree search settles for a segment guaranteed to fit */
+#define VMEM_BESTFIT_PROBES 4
+
+#ifndef VMEM_COMPACT_SCAN
+#    define VMEM_COMPACT_SCAN 64
+#endif
+
+#ifndef VMEM_PAGE_SIZE
+#    define VMEM_PAGE_SIZE 4096
+#endif
+
+/* Probe points on the hot paths (see tools/vmem_latency.bt). Each one carries the arena name, the size and flags of the request
+ * and a step count specific to the stage. They compile to nothing unless USDT is available (VMEM_USDT, hosted builds) or the user
+ * defines a `vmem_trace_hook(probe, name, size, vmflag, steps)` macro (freestanding builds). */
+#if defined(VMEM_USDT) && !defined(__KERNEL__)
+#    include <sys/sdt.h>
+#    define VMEM_TRACE(probe, vmp, size, vmflag, steps) DTRACE_PROBE4(tinyvmem, probe, (vmp)->name, size, vmflag, steps)
+#elif defined(__KERNEL__) && defined(vmem_trace_hook)
+#    define VMEM_TRACE(probe, vmp, size, vmflag, steps) vmem_trace_hook(#probe, (vmp)->name, size, vmflag, steps)
+#else
+#    define VMEM_TRACE(probe, vmp, size, vmflag, steps) ((void)(steps))
 #endif
 
 #define ARR_SIZE(x) (sizeof(x) / sizeof(*x))
 #define VMEM_ADDR_MIN 0
 #define VMEM_ADDR_MAX (~(uintptr_t)0)
 
+/* Flags that place allocations by address instead of following the allocation policy */
+#define VM_PLACEMENT (VM_TOPDOWN | VM_SHORTLIVED | VM_LONGLIVED)
+
+/* Number of pending deferred frees past which vmem_xfree() drains the queue */
+#define VMEM_DEFERRED_DRAIN (VMEM_DEFERRED_N / 2)
+
 /* Assuming FREELISTS_N is 64,
  * we can calculate the freelist index by substracting the leading zero count from 64
  * For example, the size 4096. clzl(4096) is 51, 64 - 51 is 13.
@@ -33,13 +62,16 @@
 #define VMEM_ALIGNUP(addr, align) \
     (((addr) + (align)-1) & ~((align)-1))
 
+#define VMEM_ALIGNDOWN(addr, align) \
+    ((addr) & ~((align)-1))
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 /* We need to keep a global freelist of segments because allocating virtual memory (e.g allocating a segment) requires segments to describe it. (kernel only)
  In non-kernel code, this is handled by the host `malloc` and `free` standard library functions */
 static VmemSegment static_segs[128];
-static VmemSegList free_segs = LIST_HEAD_INITIALIZER(free_segs);
+static VmemSegQueue free_segs = TAILQ_HEAD_INITIALIZER(free_segs); /* Linked through `segqueue` so that an arena's whole segment queue can be handed back at once */
 static int nfreesegs = 0;
 
 static const char *seg_type_str[] = {
@@ -57,52 +89,71 @@ void vmem_unlock(void);
 #    define vmem_unlock()
 #endif
 
-static VmemSegment *seg_alloc(void)
+static void seg_pool_put(VmemSegment *seg)
+{
+    vmem_lock();
+    TAILQ_INSERT_HEAD(&free_segs, seg, segqueue);
+    nfreesegs++;
+    vmem_unlock();
+}
+
+/* Hands all the segments of `queue` (`n` of them) back to the pool in constant time */
+static void seg_pool_put_queue(VmemSegQueue *queue, size_t n)
+{
+    vmem_lock();
+    TAILQ_CONCAT(&free_segs, queue, segqueue);
+    nfreesegs += n;
+    vmem_unlock();
+}
+
+/* Boundary tags are accounted to the arena using them (`Vmem::nsegs`), so that vmem_reset() knows how many it returns */
+static VmemSegment *seg_alloc(Vmem *vmp)
 {
     /* TODO: when bootstrapped, allocate boundary tags dynamically as described in the paper */
     VmemSegment *vsp;
 
     vmem_lock();
-    ASSERT(!LIST_EMPTY(&free_segs));
-    vsp = LIST_FIRST(&free_segs);
-    LIST_REMOVE(vsp, seglist);
+    ASSERT(!TAILQ_EMPTY(&free_segs));
+    vsp = TAILQ_FIRST(&free_segs);
+    TAILQ_REMOVE(&free_segs, vsp, segqueue);
     nfreesegs--;
     vmem_unlock();
 
+    __atomic_add_fetch(&vmp->nsegs, 1, __ATOMIC_RELAXED);
+
     return vsp;
 }
 
-static void seg_free(VmemSegment *seg)
+static void seg_free(Vmem *vmp, VmemSegment *seg)
 {
-    vmem_lock();
-    LIST_INSERT_HEAD(&free_segs, seg, seglist);
-    nfreesegs++;
-    vmem_unlock();
+    /* Don't let vmem_compact() resume from a tag that's no longer in the arena */
+    if (vmp->compact_cursor == seg)
+        vmp->compact_cursor = NULL;
+
+    seg_pool_put(seg);
+    __atomic_sub_fetch(&vmp->nsegs, 1, __ATOMIC_RELAXED);
 }
 
 static int repopulate_segments(void)
 {
-    struct
-    {
-        VmemSegment segs[64];
-    } *segblock;
+    VmemSegment *segblock;
     size_t i;
 
     if (nfreesegs >= 128)
         return 0;
 
-    /* Add 64 new segments */
+    /* Add a page worth of new segments */
     segblock = vmem_alloc_pages(1);
 
-    for (i = 0; i < ARR_SIZE(segblock->segs); i++)
+    for (i = 0; i < VMEM_PAGE_SIZE / sizeof(VmemSegment); i++)
     {
-        seg_free(&segblock->segs[i]);
+        seg_pool_put(&segblock[i]);
     }
 
     return 0;
 }
 
-static int seg_fit(VmemSegment *segment, size_t size, size_t align, size_t phase, size_t nocross, uintptr_t minaddr, uintptr_t maxaddr, uintptr_t *addrp)
+static int seg_fit(VmemSegment *segment, size_t size, size_t align, size_t phase, size_t nocross, uintptr_t minaddr, uintptr_t maxaddr, int vmflag, uintptr_t *addrp)
 {
     uintptr_t start, end;
     ASSERT(size > 0);
@@ -133,6 +184,10 @@ static int seg_fit(VmemSegment *segment, size_t size, size_t align, size_t phase
     /* Ensure that `end` is bigger than `start` and we found a segment of the proper size */
     if (start <= end && (end - start) >= size)
     {
+        /* Top-down placement: use the highest address that has the right phase and still fits. Since the lowest one fits, this one can't be below it */
+        if (vmflag & (VM_TOPDOWN | VM_LONGLIVED))
+            start = VMEM_ALIGNDOWN(end - size - phase, align) + phase;
+
         *addrp = start;
         return 0;
     }
@@ -183,9 +238,241 @@ static int vmem_contains(Vmem *vmp, void *address, size_t size)
     return false;
 }
 
+/* The size tree and the address tree share their AVL code, `addr` selects which one a function works on */
+#define TREE(seg, addr) ((addr) ? &(seg)->addrtree : &(seg)->sizetree)
+#define TREE_HEIGHT(seg, addr) ((seg) != NULL ? TREE(seg, addr)->height : 0)
+#define TREE_MAX_SIZE(seg) ((seg) != NULL ? (seg)->addrtree.max_size : 0)
+
+/* Returns true if the key (size_a, base_a) orders before (size_b, base_b) in the size tree */
+static bool sizetree_less(size_t size_a, uintptr_t base_a, size_t size_b, uintptr_t base_b)
+{
+    return size_a < size_b || (size_a == size_b && base_a < base_b);
+}
+
+static bool tree_less(VmemSegment *a, VmemSegment *b, bool addr)
+{
+    if (addr)
+        return a->base < b->base;
+
+    return sizetree_less(a->size, a->base, b->size, b->base);
+}
+
+static VmemSegment *tree_update(VmemSegment *seg, bool addr)
+{
+    VmemTree *node = TREE(seg, addr);
+
+    node->height = 1 + MAX(TREE_HEIGHT(node->left, addr), TREE_HEIGHT(node->right, addr));
+
+    /* The address tree also tracks the largest segment of each subtree, so that searches can skip the subtrees where nothing fits */
+    if (addr)
+        node->max_size = MAX(seg->size, MAX(TREE_MAX_SIZE(node->left), TREE_MAX_SIZE(node->right)));
+
+    return seg;
+}
+
+static VmemSegment *tree_rotate_right(VmemSegment *seg, bool addr)
+{
+    VmemSegment *left = TREE(seg, addr)->left;
+
+    TREE(seg, addr)->left = TREE(left, addr)->right;
+    TREE(left, addr)->right = tree_update(seg, addr);
+
+    return tree_update(left, addr);
+}
+
+static VmemSegment *tree_rotate_left(VmemSegment *seg, bool addr)
+{
+    VmemSegment *right = TREE(seg, addr)->right;
+
+    TREE(seg, addr)->right = TREE(right, addr)->left;
+    TREE(right, addr)->left = tree_update(seg, addr);
+
+    return tree_update(right, addr);
+}
+
+/* Restores the AVL invariant at `seg` after one of its subtrees changed height by at most one */
+static VmemSegment *tree_balance(VmemSegment *seg, bool addr)
+{
+    VmemSegment *left = TREE(seg, addr)->left, *right = TREE(seg, addr)->right;
+    int balance = TREE_HEIGHT(left, addr) - TREE_HEIGHT(right, addr);
+
+    if (balance > 1)
+    {
+        if (TREE_HEIGHT(TREE(left, addr)->left, addr) < TREE_HEIGHT(TREE(left, addr)->right, addr))
+            TREE(seg, addr)->left = tree_rotate_left(left, addr);
+
+        return tree_rotate_right(seg, addr);
+    }
+
+    if (balance < -1)
+    {
+        if (TREE_HEIGHT(TREE(right, addr)->right, addr) < TREE_HEIGHT(TREE(right, addr)->left, addr))
+            TREE(seg, addr)->right = tree_rotate_right(right, addr);
+
+        return tree_rotate_left(seg, addr);
+    }
+
+    return tree_update(seg, addr);
+}
+
+static VmemSegment *tree_insert(VmemSegment *root, VmemSegment *seg, bool addr)
+{
+    if (root == NULL)
+    {
+        TREE(seg, addr)->left = TREE(seg, addr)->right = NULL;
+        return tree_update(seg, addr);
+    }
+
+    if (tree_less(seg, root, addr))
+        TREE(root, addr)->left = tree_insert(TREE(root, addr)->left, seg, addr);
+    else
+        TREE(root, addr)->right = tree_insert(TREE(root, addr)->right, seg, addr);
+
+    return tree_balance(root, addr);
+}
+
+static VmemSegment *tree_remove_min(VmemSegment *root, VmemSegment **minp, bool addr)
+{
+    if (TREE(root, addr)->left == NULL)
+    {
+        *minp = root;
+        return TREE(root, addr)->right;
+    }
+
+    TREE(root, addr)->left = tree_remove_min(TREE(root, addr)->left, minp, addr);
+
+    return tree_balance(root, addr);
+}
+
+static VmemSegment *tree_remove(VmemSegment *root, VmemSegment *seg, bool addr)
+{
+    VmemSegment *min, *right;
+
+    ASSERT(root != NULL);
+
+    if (root == seg)
+    {
+        if (TREE(seg, addr)->right == NULL)
+            return TREE(seg, addr)->left;
+
+        /* Replace the segment by its in-order successor */
+        right = tree_remove_min(TREE(seg, addr)->right, &min, addr);
+        TREE(min, addr)->left = TREE(seg, addr)->left;
+        TREE(min, addr)->right = right;
+
+        return tree_balance(min, addr);
+    }
+
+    if (tree_less(seg, root, addr))
+        TREE(root, addr)->left = tree_remove(TREE(root, addr)->left, seg, addr);
+    else
+        TREE(root, addr)->right = tree_remove(TREE(root, addr)->right, seg, addr);
+
+    return tree_balance(root, addr);
+}
+
+/* Returns the first free segment whose key is at least (size, base), that is the smallest one that's big enough, lowest address first */
+static VmemSegment *sizetree_lower_bound(VmemSegment *root, size_t size, uintptr_t base)
+{
+    VmemSegment *ret = NULL;
+
+    while (root != NULL)
+    {
+        if (sizetree_less(root->size, root->base, size, base))
+        {
+            root = root->sizetree.right;
+        }
+        else
+        {
+            ret = root;
+            root = root->sizetree.left;
+        }
+    }
+
+    return ret;
+}
+
+/* Returns the free segment with the highest (`top`) or lowest address that fits the allocation. Subtrees without a segment
+ * big enough, or entirely outside [minaddr, maxaddr), are skipped, so unless alignment gets in the way this takes O(log n). */
+static VmemSegment *addrtree_search(VmemSegment *root, size_t size, size_t align, size_t phase, size_t nocross, uintptr_t minaddr, uintptr_t maxaddr, int vmflag, bool top, uintptr_t *addrp, size_t *steps)
+{
+    VmemSegment *ret;
+
+    if (root == NULL || root->addrtree.max_size < size)
+        return NULL;
+
+    (*steps)++;
+
+    /* The right subtree lies after the segment and the left one before it */
+    if (top ? root->base + root->size < maxaddr : root->base > minaddr)
+    {
+        ret = addrtree_search(top ? root->addrtree.right : root->addrtree.left, size, align, phase, nocross, minaddr, maxaddr, vmflag, top, addrp, steps);
+
+        if (ret != NULL)
+            return ret;
+    }
+
+    if (root->size >= size && seg_fit(root, size, align, phase, nocross, minaddr, maxaddr, vmflag, addrp) == 0)
+        return root;
+
+    if (top ? root->base > minaddr : root->base + root->size < maxaddr)
+        return addrtree_search(top ? root->addrtree.left : root->addrtree.right, size, align, phase, nocross, minaddr, maxaddr, vmflag, top, addrp, steps);
+
+    return NULL;
+}
+
+/* The size tree is only kept by arenas created with VM_BESTFIT and the address tree by arenas created with a placement hint,
+ * the others keep constant-time freelist updates */
 static void vmem_add_to_freelist(Vmem *vm, VmemSegment *seg)
 {
     LIST_INSERT_HEAD(freelist_for_size(vm, seg->size), seg, seglist);
+
+    if (vm->vmflag & VM_BESTFIT)
+        vm->sizetree = tree_insert(vm->sizetree, seg, false);
+
+    if (vm->vmflag & VM_PLACEMENT)
+        vm->addrtree = tree_insert(vm->addrtree, seg, true);
+}
+
+static void vmem_remove_from_freelist(Vmem *vm, VmemSegment *seg)
+{
+    LIST_REMOVE(seg, seglist);
+
+    if (vm->vmflag & VM_BESTFIT)
+        vm->sizetree = tree_remove(vm->sizetree, seg, false);
+
+    if (vm->vmflag & VM_PLACEMENT)
+        vm->addrtree = tree_remove(vm->addrtree, seg, true);
+}
+
+/* Finds the free segment with the highest (VM_TOPDOWN, VM_LONGLIVED) or lowest (VM_SHORTLIVED) address that fits the allocation */
+static VmemSegment *vmem_find_placed(Vmem *vmp, size_t size, size_t align, size_t phase, size_t nocross, uintptr_t minaddr, uintptr_t maxaddr, int vmflag, uintptr_t *addrp, size_t *steps)
+{
+    VmemSegList *list;
+    VmemSegment *seg, *best = NULL;
+    uintptr_t start;
+    bool top = (vmflag & (VM_TOPDOWN | VM_LONGLIVED)) != 0;
+
+    if (vmp->vmflag & VM_PLACEMENT)
+        return addrtree_search(vmp->addrtree, size, align, phase, nocross, minaddr, maxaddr, vmflag, top, addrp, steps);
+
+    /* Without the address tree, every free segment that may be big enough has to be looked at */
+    for (list = freelist_for_size(vmp, size); list < &vmp->freelist[FREELISTS_N]; list++)
+    {
+        LIST_FOREACH(seg, list, seglist)
+        {
+            (*steps)++;
+
+            if (seg->size >= size && (best == NULL || (top ? seg->base > best->base : seg->base < best->base)) &&
+                seg_fit(seg, size, align, phase, nocross, minaddr, maxaddr, vmflag, &start) == 0)
+            {
+                best = seg;
+                *addrp = start;
+            }
+        }
+    }
+
+    return best;
 }
 
 static void vmem_insert_segment(Vmem *vm, VmemSegment *seg, VmemSegment *prev)
@@ -194,11 +481,90 @@ static void vmem_insert_segment(Vmem *vm, VmemSegment *seg, VmemSegment *prev)
     TAILQ_INSERT_AFTER(&vm->segqueue, prev, seg, segqueue);
 }
 
+/* Heapsort, so that no memory (and no libc) is needed to sort ranges */
+static void range_sift_down(VmemRange *ranges, size_t root, size_t n)
+{
+    size_t child;
+    VmemRange tmp;
+
+    while ((child = root * 2 + 1) < n)
+    {
+        if (child + 1 < n && (uintptr_t)ranges[child + 1].base > (uintptr_t)ranges[child].base)
+            child++;
+
+        if ((uintptr_t)ranges[root].base >= (uintptr_t)ranges[child].base)
+            return;
+
+        tmp = ranges[root];
+        ranges[root] = ranges[child];
+        ranges[child] = tmp;
+
+        root = child;
+    }
+}
+
+static void range_sort(VmemRange *ranges, size_t n)
+{
+    size_t i;
+    VmemRange tmp;
+
+    for (i = n / 2; i-- > 0;)
+        range_sift_down(ranges, i, n);
+
+    for (i = n; i-- > 1;)
+    {
+        tmp = ranges[0];
+        ranges[0] = ranges[i];
+        ranges[i] = tmp;
+
+        range_sift_down(ranges, 0, i);
+    }
+}
+
+static void vmem_xfree_internal(Vmem *vmp, void *addr, size_t size);
+
+/* Returns every pending deferred free to the arena. Only ever called by the thread that owns the arena (allocating from it,
+ * or freeing once the queue fills up), so there is a single consumer. Freeing in address order lets each segment coalesce
+ * with the one freed just before it. */
+static void vmem_drain_deferred(Vmem *vmp)
+{
+    VmemRange ranges[VMEM_DEFERRED_N];
+    VmemDeferred *slot;
+    size_t n = 0, i;
+
+    /* Take every published slot and hand it back to the producers before doing the actual work */
+    while (n < VMEM_DEFERRED_N)
+    {
+        slot = &vmp->deferred[vmp->deferred_head % VMEM_DEFERRED_N];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != vmp->deferred_head + 1)
+            break;
+
+        ranges[n].base = (void *)slot->base;
+        ranges[n].size = slot->size;
+        n++;
+
+        __atomic_store_n(&slot->seq, vmp->deferred_head + VMEM_DEFERRED_N, __ATOMIC_RELEASE);
+        vmp->deferred_head++;
+    }
+
+    if (n == 0)
+        return;
+
+    range_sort(ranges, n);
+
+    for (i = 0; i < n; i++)
+    {
+        __atomic_sub_fetch(&vmp->stat.deferred, ranges[i].size, __ATOMIC_RELAXED);
+        vmem_xfree_internal(vmp, ranges[i].base, ranges[i].size);
+    }
+}
+
 static VmemSegment *vmem_add_internal(Vmem *vmem, void *base, size_t size, bool import)
 {
     VmemSegment *newspan, *newfree;
 
-    newspan = seg_alloc();
+    newspan = seg_alloc(vmem);
 
     ASSERT(newspan);
 
@@ -207,7 +573,7 @@ static VmemSegment *vmem_add_internal(Vmem *vmem, void *base, size_t size, bool
     newspan->type = SEGMENT_SPAN;
     newspan->imported = import;
 
-    newfree = seg_alloc();
+    newfree = seg_alloc(vmem);
 
     ASSERT(newfree);
 
@@ -216,23 +582,39 @@ static VmemSegment *vmem_add_internal(Vmem *vmem, void *base, size_t size, bool
     newfree->type = SEGMENT_FREE;
 
     TAILQ_INSERT_TAIL(&vmem->segqueue, newspan, segqueue);
+    LIST_INSERT_HEAD(&vmem->spanlist, newspan, seglist);
     vmem_insert_segment(vmem, newfree, newspan);
     vmem_add_to_freelist(vmem, newfree);
 
     return newfree;
 }
 
-static int vmem_import(Vmem *vmp, size_t size, int vmflag)
+/* Imports a span able to hold the allocation described by the arguments, returns its free segment or NULL */
+static VmemSegment *vmem_import(Vmem *vmp, size_t size, size_t align, size_t phase, void *minaddr, void *maxaddr, int vmflag)
 {
     void *addr;
     VmemSegment *new_seg;
-    if (!vmp->alloc)
-        return -VMEM_ERR_NO_MEM;
 
-    addr = vmp->alloc(vmp->source, size, vmflag);
+    if (vmp->xalloc)
+    {
+        /* Forward the constraints so that the parent hands out a span the allocation is guaranteed to fit in */
+        addr = vmp->xalloc(vmp->source, size, align, phase, 0, minaddr, maxaddr, vmflag);
+    }
+    else if (vmp->alloc)
+    {
+        /* The import function only knows about sizes, make the span big enough to hold an aligned allocation wherever it lands */
+        if (align > vmp->quantum)
+            size += align - vmp->quantum;
+
+        addr = vmp->alloc(vmp->source, size, vmflag);
+    }
+    else
+    {
+        return NULL;
+    }
 
     if (!addr)
-        return -VMEM_ERR_NO_MEM;
+        return NULL;
 
     new_seg = vmem_add_internal(vmp, addr, size, true);
 
@@ -241,7 +623,7 @@ static int vmem_import(Vmem *vmp, size_t size, int vmflag)
         vmp->free(vmp->source, addr, size);
     }
 
-    return 0;
+    return new_seg;
 }
 
 int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, VmemAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag)
@@ -254,6 +636,7 @@ int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, Vm
     ret->size = size;
     ret->quantum = quantum;
     ret->alloc = afunc;
+    ret->xalloc = NULL;
     ret->free = ffunc;
     ret->source = source;
     ret->qcache_max = qcache_max;
@@ -262,6 +645,10 @@ int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, Vm
     ret->stat.total += size;
     ret->stat.in_use = 0;
     ret->stat.import = 0;
+    ret->stat.deferred = 0;
+    ret->deferred_head = 0;
+    ret->deferred_tail = 0;
+    ret->nsegs = 0;
 
     LIST_INIT(&ret->spanlist);
     TAILQ_INIT(&ret->segqueue);
@@ -271,11 +658,21 @@ int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, Vm
         LIST_INIT(&ret->freelist[i]);
     }
 
+    ret->sizetree = NULL;
+    ret->addrtree = NULL;
+    ret->compact_cursor = NULL;
+    ret->compact_idle = 0;
+
     for (i = 0; i < ARR_SIZE(ret->hashtable); i++)
     {
         LIST_INIT(&ret->hashtable[i]);
     }
 
+    for (i = 0; i < ARR_SIZE(ret->deferred); i++)
+    {
+        ret->deferred[i].seq = i;
+    }
+
     /* Add initial span */
     if (!source && size)
         vmem_add(ret, base, size, vmflag);
@@ -283,18 +680,96 @@ int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, Vm
     return 0;
 }
 
+int vmem_xinit(Vmem *ret, char *name, void *base, size_t size, size_t quantum, VmemXAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag)
+{
+    vmem_init(ret, name, base, size, quantum, NULL, ffunc, source, qcache_max, vmflag);
+    ret->xalloc = afunc;
+
+    return 0;
+}
+
+void vmem_reset(Vmem *vmp)
+{
+    VmemSegment *span, *seg;
+    VmemDeferred *slot;
+    size_t i, nspans = 0;
+
+    /* Pending deferred frees are dropped along with everything else */
+    while (true)
+    {
+        slot = &vmp->deferred[vmp->deferred_head % VMEM_DEFERRED_N];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != vmp->deferred_head + 1)
+            break;
+
+        __atomic_sub_fetch(&vmp->stat.deferred, slot->size, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->seq, vmp->deferred_head + VMEM_DEFERRED_N, __ATOMIC_RELEASE);
+        vmp->deferred_head++;
+    }
+
+    /* Pull the span markers out of the segment queue, everything that's left goes back to the pool in one go */
+    LIST_FOREACH(span, &vmp->spanlist, seglist)
+    {
+        TAILQ_REMOVE(&vmp->segqueue, span, segqueue);
+        nspans++;
+    }
+
+    seg_pool_put_queue(&vmp->segqueue, vmp->nsegs - nspans);
+    vmp->nsegs = nspans;
+
+    for (i = 0; i < ARR_SIZE(vmp->freelist); i++)
+    {
+        LIST_INIT(&vmp->freelist[i]);
+    }
+
+    vmp->sizetree = NULL;
+    vmp->addrtree = NULL;
+    vmp->compact_cursor = NULL;
+    vmp->compact_idle = 0;
+
+    for (i = 0; i < ARR_SIZE(vmp->hashtable); i++)
+    {
+        LIST_INIT(&vmp->hashtable[i]);
+    }
+
+    /* Give each span a single free segment. The span list is LIFO, so inserting at the head restores the original order */
+    LIST_FOREACH(span, &vmp->spanlist, seglist)
+    {
+        seg = seg_alloc(vmp);
+
+        ASSERT(seg);
+
+        seg->type = SEGMENT_FREE;
+        seg->imported = false;
+        seg->base = span->base;
+        seg->size = span->size;
+
+        TAILQ_INSERT_HEAD(&vmp->segqueue, span, segqueue);
+        vmem_insert_segment(vmp, seg, span);
+        vmem_add_to_freelist(vmp, seg);
+    }
+
+    vmp->stat.free += vmp->stat.in_use;
+    vmp->stat.in_use = 0;
+}
+
 void vmem_destroy(Vmem *vmp)
 {
-    VmemSegment *seg;
-    size_t i;
+    VmemSegment *span;
 
-    for (i = 0; i < sizeof(vmp->hashtable) / sizeof(*vmp->hashtable); i++)
-        ASSERT(LIST_EMPTY(&vmp->hashtable[i]));
+    vmem_reset(vmp);
 
-    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    /* Give imported spans back to the source, then all the boundary tags back to the pool */
+    LIST_FOREACH(span, &vmp->spanlist, seglist)
     {
-        seg_free(seg);
+        if (span->imported && vmp->free != NULL)
+            vmp->free(vmp->source, (void *)span->base, span->size);
     }
+
+    seg_pool_put_queue(&vmp->segqueue, vmp->nsegs);
+    vmp->nsegs = 0;
+
+    LIST_INIT(&vmp->spanlist);
 }
 
 void *vmem_add(Vmem *vmp, void *addr, size_t size, int vmflag)
@@ -307,13 +782,237 @@ void *vmem_add(Vmem *vmp, void *addr, size_t size, int vmflag)
     return vmem_add_internal(vmp, addr, size, false);
 }
 
+/* Returns the last segment belonging to `span` */
+static VmemSegment *span_last(VmemSegment *span)
+{
+    VmemSegment *seg = span, *next;
+
+    while ((next = TAILQ_NEXT(seg, segqueue)) != NULL && next->type != SEGMENT_SPAN)
+        seg = next;
+
+    return seg;
+}
+
+/* Merges span `right` into span `left`, which ends where `right` begins */
+static void vmem_fuse_spans(Vmem *vmp, VmemSegment *left, VmemSegment *right)
+{
+    VmemSegment *last, *boundary, *first, *seg, *next;
+
+    ASSERT(left->base + left->size == right->base);
+    ASSERT(!left->imported && !right->imported);
+
+    /* Segments of a span must follow its marker in address order, so move those of `right` after those of `left` */
+    boundary = last = span_last(left);
+    first = TAILQ_NEXT(right, segqueue);
+
+    for (seg = first; seg != NULL && seg->type != SEGMENT_SPAN; seg = next)
+    {
+        next = TAILQ_NEXT(seg, segqueue);
+
+        TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
+        vmem_insert_segment(vmp, seg, last);
+
+        last = seg;
+    }
+
+    LIST_REMOVE(right, seglist);
+    TAILQ_REMOVE(&vmp->segqueue, right, segqueue);
+
+    left->size += right->size;
+
+    seg_free(vmp, right);
+
+    /* Coalesce the free segments on each side of the old boundary */
+    if (boundary->type == SEGMENT_FREE && first->type == SEGMENT_FREE)
+    {
+        vmem_remove_from_freelist(vmp, boundary);
+        vmem_remove_from_freelist(vmp, first);
+        TAILQ_REMOVE(&vmp->segqueue, first, segqueue);
+
+        boundary->size += first->size;
+
+        seg_free(vmp, first);
+
+        vmem_add_to_freelist(vmp, boundary);
+    }
+}
+
+/* Sorts a chain of spans linked through seglist by base address (merge sort, no memory needed) */
+static VmemSegment *span_chain_sort(VmemSegment *head)
+{
+    VmemSegment *slow, *fast, *right, *ret = NULL, **tail = &ret;
+
+    if (head == NULL || LIST_NEXT(head, seglist) == NULL)
+        return head;
+
+    /* Split the chain in two halves */
+    slow = head;
+    fast = LIST_NEXT(head, seglist);
+
+    while (fast != NULL && LIST_NEXT(fast, seglist) != NULL)
+    {
+        slow = LIST_NEXT(slow, seglist);
+        fast = LIST_NEXT(LIST_NEXT(fast, seglist), seglist);
+    }
+
+    right = LIST_NEXT(slow, seglist);
+    LIST_NEXT(slow, seglist) = NULL;
+
+    head = span_chain_sort(head);
+    right = span_chain_sort(right);
+
+    while (head != NULL && right != NULL)
+    {
+        if (head->base < right->base)
+        {
+            *tail = head;
+            head = LIST_NEXT(head, seglist);
+        }
+        else
+        {
+            *tail = right;
+            right = LIST_NEXT(right, seglist);
+        }
+
+        tail = &LIST_NEXT(*tail, seglist);
+    }
+
+    *tail = head != NULL ? head : right;
+
+    return ret;
+}
+
+/* Puts Vmem::spanlist in address order */
+static void vmem_sort_spans(Vmem *vmp)
+{
+    VmemSegment *chain = span_chain_sort(LIST_FIRST(&vmp->spanlist)), *reversed = NULL, *next;
+
+    while (chain != NULL)
+    {
+        next = LIST_NEXT(chain, seglist);
+        LIST_NEXT(chain, seglist) = reversed;
+        reversed = chain;
+        chain = next;
+    }
+
+    /* Rebuild the list (and its back pointers) from the highest span down */
+    LIST_INIT(&vmp->spanlist);
+
+    while (reversed != NULL)
+    {
+        next = LIST_NEXT(reversed, seglist);
+        LIST_INSERT_HEAD(&vmp->spanlist, reversed, seglist);
+        reversed = next;
+    }
+}
+
+/* Returns true if one of the `n` sorted, disjoint ranges overlaps a span of the arena, whose span list must be in address order */
+static bool vmem_spans_overlap(Vmem *vmp, VmemRange *ranges, size_t n)
+{
+    VmemSegment *span = LIST_FIRST(&vmp->spanlist);
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        while (span != NULL && span->base + span->size <= (uintptr_t)ranges[i].base)
+            span = LIST_NEXT(span, seglist);
+
+        if (span != NULL && span->base < (uintptr_t)ranges[i].base + ranges[i].size)
+            return true;
+    }
+
+    return false;
+}
+
+int vmem_add_bulk(Vmem *vmp, VmemRange *ranges, size_t n, int vmflag)
+{
+    VmemSegment *newfree, *span, *prev = NULL, *other, *next;
+    uintptr_t base, end;
+    size_t i, m = 0;
+
+    range_sort(ranges, n);
+
+    /* Merge back to back ranges in place */
+    for (i = 0; i < n; i++)
+    {
+        if (ranges[i].size == 0)
+            continue;
+
+        if (m > 0 && (uintptr_t)ranges[m - 1].base + ranges[m - 1].size == (uintptr_t)ranges[i].base)
+        {
+            ranges[m - 1].size += ranges[i].size;
+            continue;
+        }
+
+        if (m > 0 && (uintptr_t)ranges[m - 1].base + ranges[m - 1].size > (uintptr_t)ranges[i].base)
+            return -VMEM_ERR_OVERLAP;
+
+        ranges[m++] = ranges[i];
+    }
+
+    /* Validate everything before touching the arena, so that a bad map leaves it as it was */
+    vmem_sort_spans(vmp);
+
+    if (vmem_spans_overlap(vmp, ranges, m))
+        return -VMEM_ERR_OVERLAP;
+
+    /* Walk the existing spans in address order alongside the ranges: `prev` is the last span ending at or before the
+     * current range and `other` the first one after it. New spans are inserted at the head of the list, behind the walk. */
+    other = LIST_FIRST(&vmp->spanlist);
+
+    for (i = 0; i < m; i++)
+    {
+        base = (uintptr_t)ranges[i].base;
+        end = base + ranges[i].size;
+
+        while (other != NULL && other->base + other->size <= base)
+        {
+            prev = other;
+            other = LIST_NEXT(other, seglist);
+        }
+
+        if (!(vmflag & VM_BOOTSTRAP))
+            ASSERT(repopulate_segments() == 0);
+
+        vmp->stat.free += ranges[i].size;
+        vmp->stat.total += ranges[i].size;
+
+        newfree = vmem_add_internal(vmp, ranges[i].base, ranges[i].size, false);
+        span = TAILQ_PREV(newfree, VmemSegQueue, segqueue);
+
+        if (!(vmflag & VM_FUSE))
+            continue;
+
+        /* Ranges were merged already, so the neighbours can't be from this call */
+        if (prev != NULL && !prev->imported && prev->base + prev->size == base)
+        {
+            vmem_fuse_spans(vmp, prev, span);
+            span = prev;
+        }
+
+        if (other != NULL && !other->imported && end == other->base)
+        {
+            /* `other` is freed by the fusion, and the next range may touch the end of the merged span */
+            next = other;
+            other = LIST_NEXT(other, seglist);
+            vmem_fuse_spans(vmp, span, next);
+            prev = span;
+        }
+    }
+
+    return 0;
+}
+
 void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
                   size_t nocross, void *minaddr, void *maxaddr, int vmflag)
 {
     VmemSegList *first_list = freelist_for_size(vmp, size), *end = &vmp->freelist[FREELISTS_N], *list = NULL;
-    VmemSegment *new_seg = NULL, *new_seg2 = NULL, *seg = NULL;
-    uintptr_t start = 0;
+    VmemSegment *new_seg = NULL, *new_seg2 = NULL, *seg = NULL, *best = NULL, *jump;
+    uintptr_t start = 0, best_start = 0;
     void *ret = NULL;
+    size_t steps = 0, imports = 0, probes, slack;
+
+    VMEM_TRACE(alloc_entry, vmp, size, vmflag, 0);
 
     ASSERT(nocross == 0 && "Not implemented yet");
 
@@ -326,77 +1025,150 @@ void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
     }
 
     if (!(vmflag & VM_BOOTSTRAP))
+    {
+        VMEM_TRACE(repopulate_entry, vmp, size, vmflag, nfreesegs);
         ASSERT(repopulate_segments() == 0);
+        VMEM_TRACE(repopulate_return, vmp, size, vmflag, nfreesegs);
+    }
+
+    vmem_drain_deferred(vmp);
 
     /* Allocate the new segments */
     /* NOTE: new_seg2 might be unused, in that case, it is freed */
-    new_seg = seg_alloc();
-    new_seg2 = seg_alloc();
+    new_seg = seg_alloc(vmp);
+    new_seg2 = seg_alloc(vmp);
 
     ASSERT(new_seg && new_seg2);
 
+    /* If the size is not a power of two, instant-fit uses freelist[n+1] instead of freelist[n] */
+    if ((vmflag & VM_INSTANTFIT) && !(vmflag & VM_PLACEMENT) && (size & (size - 1)) != 0)
+    {
+        first_list++;
+    }
+
     while (true)
     {
-        if (vmflag & VM_INSTANTFIT) /* VM_INSTANTFIT */
+        VMEM_TRACE(search_entry, vmp, size, vmflag, imports);
+
+        if (vmflag & VM_PLACEMENT) /* Placement hints take precedence over the policy */
         {
-            /* If the size is not a power of two, use freelist[n+1] instead of freelist[n] */
-            if ((size & (size - 1)) != 0)
-            {
-                first_list++;
-            }
+            seg = vmem_find_placed(vmp, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, vmflag, &start, &steps);
 
+            if (seg != NULL)
+                goto found;
+        }
+        else if (vmflag & VM_INSTANTFIT) /* VM_INSTANTFIT */
+        {
             /* We just get the first segment from the list. This ensures constant-time allocation.
              * Note that we do not need to check the size of the segments because they are guaranteed to be big enough (see freelist_for_size)
              */
             for (list = first_list; list < end; list++)
             {
+                steps++;
                 seg = LIST_FIRST(list);
                 if (seg != NULL)
                 {
-                    if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
+                    if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, vmflag, &start) == 0)
                         goto found;
                 }
             }
         }
 
-        else if (vmflag & VM_BESTFIT) /* VM_BESTFIT */
+        else if ((vmflag & VM_BESTFIT) && (vmp->vmflag & VM_BESTFIT)) /* VM_BESTFIT, with a size tree */
         {
-            /* TODO: Should we bother going through the entire list to find the absolute best fit? */
+            /* The size tree gives us the smallest segment that is big enough (lowest address first on ties) in O(log n).
+             * It only fails to fit when alignment or an address range gets in the way, in which case we move on to the next bigger segment. */
+            slack = size + (align > vmp->quantum ? align - vmp->quantum : 0) + phase;
+            probes = 0;
 
-            /* We go through every segment in every list until we find the smallest free segment that can satisfy the allocation */
-            for (list = first_list; list < end; list++)
-                LIST_FOREACH(seg, list, seglist)
+            for (seg = sizetree_lower_bound(vmp->sizetree, size, 0); seg != NULL;
+                 seg = seg->base == VMEM_ADDR_MAX ? sizetree_lower_bound(vmp->sizetree, seg->size + 1, 0) : sizetree_lower_bound(vmp->sizetree, seg->size, seg->base + 1))
+            {
+                steps++;
+
+                if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, vmflag, &start) == 0)
+                    goto found;
+
+                /* After a few misses, give up on the exact best fit and jump to the segments with room for the alignment slack:
+                 * they fit wherever they start, so the first one ends the search. Without an address range, the cost is then
+                 * bounded by VMEM_BESTFIT_PROBES lookups; if there is no such segment, the walk goes on through the smaller ones. */
+                if (++probes == VMEM_BESTFIT_PROBES && minaddr == (void *)VMEM_ADDR_MIN && maxaddr == (void *)VMEM_ADDR_MAX &&
+                    sizetree_less(seg->size, seg->base, slack, 0) && (jump = sizetree_lower_bound(vmp->sizetree, slack, 0)) != NULL)
                 {
-                    if (seg->size >= size)
+                    steps++;
+
+                    if (seg_fit(jump, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, vmflag, &start) == 0)
                     {
+                        seg = jump;
+                        goto found;
+                    }
+                }
+            }
+        }
+        else if (vmflag & VM_BESTFIT) /* VM_BESTFIT, without a size tree */
+        {
+            /* The smallest segment that fits is in the first list holding one that fits, but we have to go through all of that list to find it */
+            for (list = first_list; list < end && best == NULL; list++)
+                LIST_FOREACH(seg, list, seglist)
+                {
+                    steps++;
 
-                        /* Try to make the segment fit */
-                        if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
-                            goto found;
+                    if (seg->size >= size && (best == NULL || sizetree_less(seg->size, seg->base, best->size, best->base)) &&
+                        seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, vmflag, &start) == 0)
+                    {
+                        best = seg;
+                        best_start = start;
                     }
                 }
+
+            if (best != NULL)
+            {
+                seg = best;
+                start = best_start;
+                goto found;
+            }
         }
         else if (vmflag & VM_NEXTFIT)
         {
             ASSERT(!"TODO: implement nextfit");
         }
 
-        if (vmem_import(vmp, size, vmflag) == 0)
+        VMEM_TRACE(search_return, vmp, size, vmflag, steps);
+        VMEM_TRACE(import_entry, vmp, size, vmflag, imports);
+
+        imports++;
+
+        seg = vmem_import(vmp, size, align, phase, minaddr, maxaddr, vmflag);
+
+        if (seg != NULL)
         {
+            VMEM_TRACE(import_return, vmp, size, vmflag, imports);
+
+            /* Allocate straight from the new span: it was sized for this allocation but may sit in a freelist the policy wouldn't look at
+             * (e.g. a non power of two size with instant-fit), and searching again would only import another one */
+            if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, vmflag, &start) == 0)
+                goto imported;
+
             continue;
         }
 
+        VMEM_TRACE(import_return, vmp, size, vmflag, imports);
+        VMEM_TRACE(alloc_return, vmp, size, vmflag, imports);
+
         ASSERT(!"Allocation failed");
         return NULL;
     }
 
 found:
+    VMEM_TRACE(search_return, vmp, size, vmflag, steps);
+
+imported:
     ASSERT(seg != NULL);
     ASSERT(seg->type == SEGMENT_FREE);
     ASSERT(seg->size >= size);
 
     /* Remove the segment from the freelist, it may be added back when modified */
-    LIST_REMOVE(seg, seglist);
+    vmem_remove_from_freelist(vmp, seg);
 
     if (seg->base != start)
     {
@@ -455,12 +1227,12 @@ found:
     {
         seg->type = SEGMENT_ALLOCATED;
         hashtab_insert(vmp, seg);
-        seg_free(new_seg);
+        seg_free(vmp, new_seg);
         new_seg = seg;
     }
 
     if (new_seg2 != NULL)
-        seg_free(new_seg2);
+        seg_free(vmp, new_seg2);
 
     ASSERT(new_seg->size >= size);
 
@@ -468,9 +1240,13 @@ found:
     vmp->stat.in_use += new_seg->size;
 
     new_seg->type = SEGMENT_ALLOCATED;
+    new_seg->constrained = align > vmp->quantum || phase != 0 || minaddr != (void *)VMEM_ADDR_MIN || maxaddr != (void *)VMEM_ADDR_MAX ||
+                           (vmflag & (VM_TOPDOWN | VM_LONGLIVED));
 
     ret = (void *)new_seg->base;
 
+    VMEM_TRACE(alloc_return, vmp, size, vmflag, imports);
+
     return ret;
 }
 
@@ -479,21 +1255,28 @@ void *vmem_alloc(Vmem *vmp, size_t size, int vmflag)
     return vmem_xalloc(vmp, size, 0, 0, 0, (void *)VMEM_ADDR_MIN, (void *)VMEM_ADDR_MAX, vmflag);
 }
 
-void vmem_xfree(Vmem *vmp, void *addr, size_t size)
+static void vmem_xfree_internal(Vmem *vmp, void *addr, size_t size)
 {
     VmemSegment *seg, *neighbor;
     VmemSegList *list;
+    size_t steps = 0;
+
+    VMEM_TRACE(hash_entry, vmp, size, 0, 0);
 
     list = hashtable_for_addr(vmp, (uintptr_t)addr);
 
     LIST_FOREACH(seg, list, seglist)
     {
+        steps++;
+
         if (seg->base == (uintptr_t)addr)
         {
             break;
         }
     }
 
+    VMEM_TRACE(hash_return, vmp, size, 0, steps);
+
     ASSERT(seg->size == size);
 
     /* Remove the segment from the hashtable */
@@ -505,13 +1288,13 @@ void vmem_xfree(Vmem *vmp, void *addr, size_t size)
     if (neighbor && neighbor->type == SEGMENT_FREE)
     {
         /* Remove our neighbor since we're merging with it */
-        LIST_REMOVE(neighbor, seglist);
+        vmem_remove_from_freelist(vmp, neighbor);
 
         TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
 
         seg->size += neighbor->size;
 
-        seg_free(neighbor);
+        seg_free(vmp, neighbor);
     }
 
     /* Coalesce to the left */
@@ -519,13 +1302,13 @@ void vmem_xfree(Vmem *vmp, void *addr, size_t size)
 
     if (neighbor->type == SEGMENT_FREE)
     {
-        LIST_REMOVE(neighbor, seglist);
+        vmem_remove_from_freelist(vmp, neighbor);
         TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
 
         seg->size += neighbor->size;
         seg->base = neighbor->base;
 
-        seg_free(neighbor);
+        seg_free(vmp, neighbor);
     }
 
     neighbor = TAILQ_PREV(seg, VmemSegQueue, segqueue);
@@ -540,9 +1323,10 @@ void vmem_xfree(Vmem *vmp, void *addr, size_t size)
         size_t span_size = seg->size;
 
         TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
-        seg_free(seg);
+        seg_free(vmp, seg);
         TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
-        seg_free(neighbor);
+        LIST_REMOVE(neighbor, seglist);
+        seg_free(vmp, neighbor);
 
         vmp->free(vmp->source, (void *)span_addr, span_size);
     }
@@ -555,11 +1339,269 @@ void vmem_xfree(Vmem *vmp, void *addr, size_t size)
     vmp->stat.free += size;
 }
 
+void vmem_xfree(Vmem *vmp, void *addr, size_t size)
+{
+    vmem_xfree_internal(vmp, addr, size);
+
+    /* Unlike allocations, frees only drain the deferred queue once it's filling up, so that an owner that stops
+     * allocating still makes room for the producers. Claimed but unpublished slots count too, it's only a hint. */
+    if (__atomic_load_n(&vmp->deferred_tail, __ATOMIC_RELAXED) - vmp->deferred_head >= VMEM_DEFERRED_DRAIN)
+        vmem_drain_deferred(vmp);
+}
+
 void vmem_free(Vmem *vmp, void *addr, size_t size)
 {
     vmem_xfree(vmp, addr, size);
 }
 
+int vmem_free_deferred(Vmem *vmp, void *addr, size_t size)
+{
+    VmemDeferred *slot;
+    size_t pos, seq;
+
+    /* Bounded MPSC queue (Vyukov): a slot's sequence number says whether it is free for position `pos` (seq == pos)
+     * or still holds an entry from the previous lap (seq < pos). Producers claim a position with a CAS on the tail,
+     * fill the slot and publish it by bumping its sequence number. Nothing here touches the arena or the tag pool. */
+    pos = __atomic_load_n(&vmp->deferred_tail, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        slot = &vmp->deferred[pos % VMEM_DEFERRED_N];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&vmp->deferred_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0)
+        {
+            /* Full, the owner makes room on its next allocation or free */
+            return -VMEM_ERR_NO_MEM;
+        }
+        else
+        {
+            pos = __atomic_load_n(&vmp->deferred_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->base = (uintptr_t)addr;
+    slot->size = size;
+
+    __atomic_add_fetch(&vmp->stat.deferred, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Allocates the first `size` bytes of the free segment `seg` */
+static void vmem_carve(Vmem *vmp, VmemSegment *seg, size_t size)
+{
+    VmemSegment *new_seg;
+
+    ASSERT(seg->type == SEGMENT_FREE);
+    ASSERT(seg->size >= size);
+
+    vmem_remove_from_freelist(vmp, seg);
+
+    if (seg->size != size)
+    {
+        /* Split off the allocated head and put the rest back on the freelists */
+        new_seg = seg_alloc(vmp);
+
+        ASSERT(new_seg);
+
+        new_seg->type = SEGMENT_ALLOCATED;
+        new_seg->imported = false;
+        new_seg->base = seg->base;
+        new_seg->size = size;
+
+        seg->base += size;
+        seg->size -= size;
+
+        vmem_add_to_freelist(vmp, seg);
+        vmem_insert_segment(vmp, new_seg, TAILQ_PREV(seg, VmemSegQueue, segqueue));
+
+        seg = new_seg;
+    }
+    else
+    {
+        seg->type = SEGMENT_ALLOCATED;
+    }
+
+    seg->constrained = false;
+    hashtab_insert(vmp, seg);
+
+    vmp->stat.free -= size;
+    vmp->stat.in_use += size;
+}
+
+int vmem_alloc_sg(Vmem *vmp, size_t total, size_t min_chunk, VmemRange *vec, size_t max_entries, int vmflag)
+{
+    VmemSegment *seg, *next;
+    size_t remaining, take, n = 0, i;
+
+    ASSERT(max_entries > 0);
+
+    /* Nothing to allocate, don't leave an empty allocated segment behind */
+    if (total == 0)
+        return 0;
+
+    total = VMEM_ALIGNUP(total, vmp->quantum);
+    min_chunk = VMEM_ALIGNUP(MAX(min_chunk, vmp->quantum), vmp->quantum);
+    remaining = total;
+
+    vmem_drain_deferred(vmp);
+
+    while (true)
+    {
+        /* Walk the freelists from the biggest size class down to the one holding `min_chunk`, so that we use as few ranges as possible */
+        for (i = FREELISTS_N; i-- > (size_t)(freelist_for_size(vmp, min_chunk) - vmp->freelist);)
+        {
+            for (seg = LIST_FIRST(&vmp->freelist[i]); seg != NULL; seg = next)
+            {
+                next = LIST_NEXT(seg, seglist);
+
+                if (seg->size < min_chunk)
+                    continue;
+
+                /* The last entry must cover everything that's left */
+                if (n == max_entries - 1 && seg->size < remaining)
+                    continue;
+
+                if (!(vmflag & VM_BOOTSTRAP))
+                    ASSERT(repopulate_segments() == 0);
+
+                take = MIN(seg->size, remaining);
+
+                vec[n].base = (void *)seg->base;
+                vec[n].size = take;
+                n++;
+
+                /* Carving only ever puts a remainder back on a freelist for the last range, so `next` stays valid */
+                vmem_carve(vmp, seg, take);
+
+                remaining -= take;
+
+                if (remaining == 0)
+                    return n;
+            }
+        }
+
+        /* The free segments can't cover the request, import what's missing and take it in the next pass */
+        if (vmem_import(vmp, MAX(remaining, min_chunk), 0, 0, (void *)VMEM_ADDR_MIN, (void *)VMEM_ADDR_MAX, vmflag) == NULL)
+            break;
+    }
+
+    vmem_free_sg(vmp, vec, n);
+    return -VMEM_ERR_NO_MEM;
+}
+
+void vmem_free_sg(Vmem *vmp, VmemRange *vec, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        vmem_xfree(vmp, vec[i].base, vec[i].size);
+    }
+}
+
+size_t vmem_compact(Vmem *vmp, VmemRelocate *relocate, void *arg, size_t budget)
+{
+    VmemSegment *seg, *prev, *next, *best, *end;
+    size_t score, best_score, visits, moved = 0;
+
+    vmem_drain_deferred(vmp);
+
+    /* Each call only looks at the next VMEM_COMPACT_SCAN segments, starting where the previous one stopped */
+    if (vmp->compact_cursor == NULL)
+        vmp->compact_cursor = TAILQ_FIRST(&vmp->segqueue);
+
+    for (end = vmp->compact_cursor, visits = 0; end != NULL && visits < VMEM_COMPACT_SCAN; end = TAILQ_NEXT(end, segqueue))
+        visits++;
+
+    vmp->compact_idle += visits;
+
+    while (true)
+    {
+        best = NULL;
+        best_score = 0;
+
+        /* Sliding an allocated segment down over the free segment before it merges that free segment with the one after it (if any).
+         * Pick the move that creates the largest free area and still fits in the budget. */
+        for (seg = vmp->compact_cursor; seg != end; seg = TAILQ_NEXT(seg, segqueue))
+        {
+            if (seg->type != SEGMENT_ALLOCATED || seg->constrained || seg->size > budget - moved)
+                continue;
+
+            prev = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+
+            if (prev->type != SEGMENT_FREE)
+                continue;
+
+            next = TAILQ_NEXT(seg, segqueue);
+            score = prev->size + (next != NULL && next->type == SEGMENT_FREE ? next->size : 0);
+
+            if (score > best_score)
+            {
+                best = seg;
+                best_score = score;
+            }
+        }
+
+        if (best == NULL)
+            break;
+
+        seg = best;
+        prev = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+
+        if (relocate(arg, (void *)seg->base, (void *)prev->base, seg->size) != 0)
+            break;
+
+        /* `seg` takes the place of `prev` in the window */
+        if (vmp->compact_cursor == prev)
+            vmp->compact_cursor = seg;
+
+        /* The allocated segment is rehashed under its new address, and the free one moves after it */
+        LIST_REMOVE(seg, seglist);
+        vmem_remove_from_freelist(vmp, prev);
+        TAILQ_REMOVE(&vmp->segqueue, prev, segqueue);
+
+        seg->base = prev->base;
+        prev->base = seg->base + seg->size;
+
+        TAILQ_INSERT_AFTER(&vmp->segqueue, seg, prev, segqueue);
+
+        /* Coalesce with the free segment that was after the allocated one */
+        next = TAILQ_NEXT(prev, segqueue);
+
+        if (next != NULL && next->type == SEGMENT_FREE)
+        {
+            if (end == next)
+                end = TAILQ_NEXT(next, segqueue);
+
+            vmem_remove_from_freelist(vmp, next);
+            TAILQ_REMOVE(&vmp->segqueue, next, segqueue);
+
+            prev->size += next->size;
+
+            seg_free(vmp, next);
+        }
+
+        hashtab_insert(vmp, seg);
+        vmem_add_to_freelist(vmp, prev);
+
+        moved += seg->size;
+        vmp->compact_idle = 0;
+    }
+
+    /* Past the end of the queue, the next call starts over from the beginning */
+    vmp->compact_cursor = end;
+
+    return moved;
+}
+
 void vmem_dump(Vmem *vmp)
 {
     VmemSegment *span;
@@ -587,6 +1629,7 @@ void vmem_dump(Vmem *vmp)
     vmem_printf("- in_use: %ld\n", vmp->stat.in_use);
     vmem_printf("- free: %ld\n", vmp->stat.free);
     vmem_printf("- total: %ld\n", vmp->stat.total);
+    vmem_printf("- deferred: %ld\n", vmp->stat.deferred);
 }
 
 void vmem_bootstrap(void)
@@ -594,6 +1637,6 @@ void vmem_bootstrap(void)
     size_t i;
     for (i = 0; i < ARR_SIZE(static_segs); i++)
     {
-        seg_free(&static_segs[i]);
+        seg_pool_put(&static_segs[i]);
     }
 }
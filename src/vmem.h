@@ -10,15 +10,26 @@
 #include <stdint.h>
 #include <sys/queue.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Directs vmem to use the smallest
 free segment that can satisfy the allocation. This
 policy tends to minimize fragmentation of very
-small, precious resources (cited from paper) */
+small, precious resources (cited from paper)
+
+Passed to vmem_init(), it also makes the arena keep its free segments in a size tree: best-fit
+allocations then take O(log n), but every freelist update (for all policies, vmem_free() included)
+does too. Aligned allocations stay within a few lookups: after 4 candidates that alignment rules out,
+the search takes the smallest segment with room for the alignment slack, which isn't always the best
+fit. Only an address range, or the lack of any segment that big, makes the search walk further. Without it, best-fit scans the freelists and instant-fit stays constant time. */
 #define VM_BESTFIT (1 << 0)
 
 /* Directs vmem to provide a
 good approximation to best−fit in guaranteed
-constant time. This is the default allocation policy. (cited from paper) */
+constant time. This is the default allocation policy. (cited from paper)
+Instant-fit is only constant time in arenas that weren't created with VM_BESTFIT, see above. */
 #define VM_INSTANTFIT (1 << 1)
 
 /* Directs vmem to use the next free
@@ -34,7 +45,25 @@ to cycle through all the IDs before reusing them. (cited from paper) */
    We need to allocate new segments but to allocate new segments, we need to refill the list, this flag ensures that no refilling occurs. */
 #define VM_BOOTSTRAP (1 << 5)
 
+/* Placement hint: allocate from the highest addressed free segment that fits, at its highest fitting address.
+   Placement hints take precedence over the allocation policy.
+
+Passed to vmem_init() (like the lifetime hints below), it also makes the arena keep its free segments in an address tree:
+placed allocations then take O(log n), unless alignment rules out many candidates, but every freelist update does too.
+Without it, placed allocations scan the freelists. */
+#define VM_TOPDOWN (1 << 6)
+
+/* Lifetime hints. Short-lived allocations take the lowest addressed free segment that fits and long-lived ones are placed
+   like VM_TOPDOWN, so the two classes gather at opposite ends of the arena's address range and long-lived allocations
+   don't pin short-lived regions that could otherwise coalesce. Imports forward the hint to the source arena. */
+#define VM_SHORTLIVED (1 << 8)
+#define VM_LONGLIVED (1 << 9)
+
+/* vmem_add_bulk() only: also fuse the new ranges with the existing (non-imported) spans they touch */
+#define VM_FUSE (1 << 7)
+
 #define VMEM_ERR_NO_MEM 1
+#define VMEM_ERR_OVERLAP 2
 
 struct vmem;
 
@@ -46,6 +75,13 @@ them back when all their segments have been freed. (cited from paper) These type
 typedef void *VmemAlloc(struct vmem *vmem, size_t size, int flags);
 typedef void VmemFree(struct vmem *vmem, void *addr, size_t size);
 
+/* Constrained variant of VmemAlloc, called with the constraints of the vmem_xalloc() that triggered the import (vmem_xalloc() itself fits) */
+typedef void *VmemXAlloc(struct vmem *vmem, size_t size, size_t align, size_t phase, size_t nocross, void *minaddr, void *maxaddr, int flags);
+
+/* Callback used by vmem_compact() to move a resource from `from` to `to`. The two ranges may overlap, like memmove().
+   Returns 0 if the resource was moved, anything else leaves it (and the arena) untouched. */
+typedef int VmemRelocate(void *arg, void *from, void *to, size_t size);
+
 /* We can't use boundary tags because the resource we're managing is not necessarily memory.
    To counter this, we can use *external boundary tags*. For each segment in the arena
    we allocate a boundary tag to manage it. */
@@ -54,6 +90,14 @@ typedef void VmemFree(struct vmem *vmem, void *addr, size_t size);
 #define FREELISTS_N sizeof(void *) * CHAR_BIT
 #define HASHTABLES_N 16
 
+/* Node of an AVL tree of free segments */
+typedef struct
+{
+    struct vmem_segment *left, *right;
+    int height;
+    uintptr_t max_size; /* Largest segment in the subtree, only maintained in Vmem::addrtree */
+} VmemTree;
+
 typedef struct vmem_segment
 {
     enum
@@ -63,7 +107,8 @@ typedef struct vmem_segment
         SEGMENT_SPAN
     } type;
 
-    bool imported; /* Non-zero if imported */
+    bool imported;    /* Non-zero if imported */
+    bool constrained; /* Non-zero if allocated with an alignment, phase, address range or top-down placement, which vmem_compact() can't preserve */
 
     uintptr_t base; /* base address of the segment */
     uintptr_t size; /* size of the segment */
@@ -73,6 +118,9 @@ typedef struct vmem_segment
   LIST_ENTRY(vmem_segment) seglist; /* If free, points to Vmem::freelist, if allocated, points to Vmem::hashtable, else Vmem::spanlist */
     /* clang-format on */
 
+    VmemTree sizetree; /* If free, node of Vmem::sizetree */
+    VmemTree addrtree; /* If free, node of Vmem::addrtree */
+
 } VmemSegment;
 
 typedef LIST_HEAD(VmemSegList, vmem_segment) VmemSegList;
@@ -86,8 +134,27 @@ typedef struct
     size_t total;  /* Total memory in the area */
     size_t alloc;  /* Number of allocations */
     size_t free;   /* Number of frees */
+    size_t deferred; /* Memory queued by vmem_free_deferred() but not yet returned, still counted in `in_use` */
 } VmemStat;
 
+/* A contiguous range [base, base + size) of an arena, used to describe a scatter-gather allocation */
+typedef struct
+{
+    void *base;
+    size_t size;
+} VmemRange;
+
+/* Number of frees that can be pending in an arena's deferred queue. Not configurable: it sets the layout of Vmem */
+#define VMEM_DEFERRED_N 64
+
+/* A slot of the deferred free queue, `seq` tells producers and the consumer whose turn it is */
+typedef struct
+{
+    size_t seq;
+    uintptr_t base;
+    size_t size;
+} VmemDeferred;
+
 /* Description of an arena, a collection of resources. An arena is simply a set of integers. */
 typedef struct vmem
 {
@@ -96,23 +163,42 @@ typedef struct vmem
     size_t size;         /* Size of initial span */
     size_t quantum;      /* Unit of currency */
     VmemAlloc *alloc;    /* Import alloc function */
+    VmemXAlloc *xalloc;  /* Constrained import alloc function, used instead of `alloc` when set */
     VmemFree *free;      /* Import free function */
     struct vmem *source; /* Import arena */
     size_t qcache_max;   /* Maximum size to cache */
-    int vmflag;          /* VM_SLEEP or VM_NOSLEEP */
+    int vmflag;          /* VM_SLEEP or VM_NOSLEEP, VM_BESTFIT if the arena keeps a size tree, a placement hint if it keeps an address tree */
 
     VmemSegQueue segqueue;
     VmemSegList freelist[FREELISTS_N];   /* Power of two freelists. Freelists[n] contains all free segments whose sizes are in the range [2^n, 2^n+1]  */
     VmemSegList hashtable[HASHTABLES_N]; /* Allocated segments */
     VmemSegList spanlist;                /* Span marker segments */
+    VmemSegment *sizetree;               /* Free segments in an AVL tree ordered by size, then address. Only kept with VM_BESTFIT in Vmem::vmflag */
+    VmemSegment *addrtree;               /* Free segments in an AVL tree ordered by address. Only kept with a placement hint in Vmem::vmflag */
+    size_t nsegs;                        /* Boundary tags currently used by the arena */
+    VmemSegment *compact_cursor;         /* Where the next vmem_compact() call resumes, NULL for the start of Vmem::segqueue */
+    size_t compact_idle;                 /* Segments vmem_compact() looked at since it last moved one */
+
+    VmemDeferred deferred[VMEM_DEFERRED_N]; /* Bounded lock-free queue of frees pending from other threads, see vmem_free_deferred() */
+    size_t deferred_head;                   /* Next slot to drain, only touched by allocating threads */
+    size_t deferred_tail;                   /* Next slot to fill, claimed by producers with a CAS */
 
     VmemStat stat;
 } Vmem;
 
-/* Initializes a vmem arena (no malloc) */
+/* Initializes a vmem arena (no malloc). With VM_BESTFIT in vmflag, the arena keeps a size tree for best-fit allocations,
+   with VM_TOPDOWN, VM_SHORTLIVED or VM_LONGLIVED an address tree for placed allocations */
 int vmem_init(Vmem *vmem, char *name, void *base, size_t size, size_t quantum, VmemAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag);
 
-/* Destroys arena `vmp` */
+/* Same as vmem_init(), but spans are imported with a constrained alloc function. Allocations with an alignment, phase or
+   address range then import a span that is guaranteed to satisfy them, instead of one that only has the right size. */
+int vmem_xinit(Vmem *vmem, char *name, void *base, size_t size, size_t quantum, VmemXAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag);
+
+/* Drops every allocation in arena `vmp`, leaving a single free segment per span. Unlike freeing each allocation, this
+   takes time proportional to the number of spans: boundary tags go back to the pool in bulk and nothing is coalesced. */
+void vmem_reset(Vmem *vmp);
+
+/* Destroys arena `vmp`. Outstanding allocations are dropped as with vmem_reset() and imported spans are given back to the source */
 void vmem_destroy(Vmem *vmp);
 
 /* Allocates size bytes from vmp. Returns the allocated address on success, NULL on failure.
@@ -125,6 +211,15 @@ void *vmem_alloc(Vmem *vmp, size_t size, int vmflag);
 /* Frees `size` bytes at address `addr` in arena `vmp` */
 void vmem_free(Vmem *vmp, void *addr, size_t size);
 
+/* Queues the free of `size` bytes at `addr` in arena `vmp` without touching the arena's segments or the boundary tag pool.
+   This is meant for threads that free resources allocated elsewhere and may be called from any number of threads at once:
+   the pair goes into a bounded lock-free queue of VMEM_DEFERRED_N entries, drained in address order by the thread that
+   owns the arena on its next allocation (vmem_xalloc(), vmem_alloc_sg(), vmem_compact()), or on its next free once half
+   the queue is pending. Until then the bytes are reported in `stat.deferred`. Returns 0, or -VMEM_ERR_NO_MEM if the queue
+   is full, in which case nothing was queued and the caller must retry later. Calling vmem_free() instead is only safe
+   from the owning thread, since the arena isn't locked. */
+int vmem_free_deferred(Vmem *vmp, void *addr, size_t size);
+
 /*
 Allocates size bytes at offset phase from an align boundary such that the resulting segment
 [addr, addr + size) is a subset of [minaddr, maxaddr) that does not straddle a nocross−
@@ -142,14 +237,44 @@ the original allocation was a vmem_xalloc() because both routines bypass the qua
 */
 void vmem_xfree(Vmem *vmp, void *addr, size_t size);
 
+/* Allocates `total` bytes from vmp as up to `max_entries` ranges that need not be contiguous, stored in `vec`.
+   Free segments are taken in a single pass over the freelists, largest size class first, and segments smaller than
+   `min_chunk` are skipped (only the last range, which takes what remains, may be smaller). The arena only imports when
+   its free segments cannot cover `total`. Returns the number of ranges on success (0 if `total` is 0), -VMEM_ERR_NO_MEM on
+   failure, in which case nothing is allocated. */
+int vmem_alloc_sg(Vmem *vmp, size_t total, size_t min_chunk, VmemRange *vec, size_t max_entries, int vmflag);
+
+/* Frees the `n` ranges in `vec` returned by vmem_alloc_sg() */
+void vmem_free_sg(Vmem *vmp, VmemRange *vec, size_t n);
+
+/* Compacts arena `vmp`, whose resources must be movable. Allocated segments are slid down over the free segment
+   right before them, picking first the ones whose move creates the largest contiguous free area, and `relocate` is
+   called to move the data. This is meant to be called repeatedly in the background: each call moves at most `budget` bytes
+   and only looks at the next VMEM_COMPACT_SCAN (64) segments, resuming where the previous call stopped, so it takes bounded
+   time however large the arena. Returns the number of bytes moved by this call. The arena is fully compacted once
+   `vmp->compact_idle` reaches `vmp->nsegs`, i.e. a whole pass over the segments found nothing to move.
+   Segments allocated by vmem_xalloc() with an alignment above the quantum, a phase, an address range, or VM_TOPDOWN /
+   VM_LONGLIVED placement are never moved, since sliding them down would break those constraints. */
+size_t vmem_compact(Vmem *vmp, VmemRelocate *relocate, void *arg, size_t budget);
+
 /* Adds the span [addr, addr + size) to arena vmp. Returns addr on success, NULL on failure.
    vmem_add() will fail only if vmflag is VM_NOSLEEP and no resources are currently available. (cited from paper) */
 void *vmem_add(Vmem *vmp, void *addr, size_t size, int vmflag);
 
+/* Adds the `n` ranges in `ranges` to arena vmp as spans. The ranges are sorted in place, back to back ranges are merged
+   into a single span and zero-sized ones are ignored. With VM_FUSE, they are also merged with the existing non-imported
+   spans they touch, so that allocations can straddle what used to be a boundary. Returns 0 on success, or -VMEM_ERR_OVERLAP
+   if two ranges overlap or one overlaps a span of the arena, in which case the arena is left unchanged. */
+int vmem_add_bulk(Vmem *vmp, VmemRange *ranges, size_t n, int vmflag);
+
 /* Dumps the arena `vmp` using the `kprintf` function */
 void vmem_dump(Vmem *vmp);
 
 /* Initializes Vmem */
 void vmem_bootstrap(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,349 @@
+/* Header-only C++ (17) layer over TinyVMem:
+   - tinyvmem::arena, an owning, move-only wrapper around a Vmem arena
+   - tinyvmem::allocation<T>, a typed handle that gives its resource back on scope exit
+   - tinyvmem::memory_resource, a std::pmr::memory_resource allocating straight from an arena
+   - tinyvmem::monotonic_arena, a std::pmr::memory_resource that imports chunks from a parent arena and releases them all at once
+*/
+
+#ifndef _VMEM_HPP
+#define _VMEM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <vmem.h>
+
+namespace tinyvmem
+{
+
+namespace detail
+{
+
+/* vmem_xfree() expects the exact size of the segment, and vmem_xalloc() may hand out up to a quantum more than asked,
+   so the wrappers always deal in whole quanta */
+inline size_t round_size(const Vmem *vmp, size_t size) noexcept
+{
+    if (size == 0)
+        size = 1;
+
+    return (size + vmp->quantum - 1) / vmp->quantum * vmp->quantum;
+}
+
+inline void *max_addr() noexcept
+{
+    return reinterpret_cast<void *>(~static_cast<uintptr_t>(0));
+}
+
+} // namespace detail
+
+/* Typed handle for a single allocation. It doesn't construct or destroy any T, it only types the address;
+   the resource is given back to its arena when the handle goes out of scope. */
+template <typename T>
+class allocation
+{
+public:
+    allocation() noexcept = default;
+
+    allocation(Vmem *vmp, T *ptr, size_t size) noexcept
+        : vmp_(vmp), ptr_(ptr), size_(size)
+    {
+    }
+
+    allocation(const allocation &) = delete;
+    allocation &operator=(const allocation &) = delete;
+
+    allocation(allocation &&other) noexcept
+        : vmp_(other.vmp_), ptr_(std::exchange(other.ptr_, nullptr)), size_(other.size_)
+    {
+    }
+
+    allocation &operator=(allocation &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            vmp_ = other.vmp_;
+            ptr_ = std::exchange(other.ptr_, nullptr);
+            size_ = other.size_;
+        }
+
+        return *this;
+    }
+
+    ~allocation()
+    {
+        reset();
+    }
+
+    T *get() const noexcept
+    {
+        return ptr_;
+    }
+
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr_ != nullptr;
+    }
+
+    /* Gives up ownership, the caller is now responsible for calling vmem_xfree() */
+    T *release() noexcept
+    {
+        return std::exchange(ptr_, nullptr);
+    }
+
+    void reset() noexcept
+    {
+        if (ptr_ != nullptr)
+            vmem_xfree(vmp_, ptr_, size_);
+
+        ptr_ = nullptr;
+    }
+
+private:
+    Vmem *vmp_ = nullptr;
+    T *ptr_ = nullptr;
+    size_t size_ = 0;
+};
+
+/* Owning wrapper around a Vmem arena, destroyed on scope exit.
+   The Vmem itself lives on the heap: its list heads are pointed to by the segments, so it can't be moved around. */
+class arena
+{
+public:
+    /* Creates an arena managing [base, base + size) */
+    arena(const char *name, void *base, size_t size, size_t quantum, int vmflag = 0)
+        : vmp_(new Vmem())
+    {
+        vmem_init(vmp_.get(), const_cast<char *>(name), base, size, quantum, nullptr, nullptr, nullptr, 0, vmflag);
+    }
+
+    /* Creates an empty arena that imports its spans from `source` */
+    arena(const char *name, size_t quantum, Vmem *source, int vmflag = 0)
+        : vmp_(new Vmem())
+    {
+        vmem_xinit(vmp_.get(), const_cast<char *>(name), nullptr, 0, quantum, vmem_xalloc, vmem_free, source, 0, vmflag);
+    }
+
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    arena(arena &&other) noexcept = default;
+
+    arena &operator=(arena &&other) noexcept
+    {
+        if (this != &other)
+        {
+            destroy();
+            vmp_ = std::move(other.vmp_);
+        }
+
+        return *this;
+    }
+
+    ~arena()
+    {
+        destroy();
+    }
+
+    Vmem *get() const noexcept
+    {
+        return vmp_.get();
+    }
+
+    void *alloc(size_t size, int vmflag = VM_INSTANTFIT)
+    {
+        return vmem_alloc(get(), detail::round_size(get(), size), vmflag);
+    }
+
+    void free(void *addr, size_t size)
+    {
+        vmem_free(get(), addr, detail::round_size(get(), size));
+    }
+
+    void *xalloc(size_t size, size_t align, size_t phase = 0, void *minaddr = nullptr, void *maxaddr = detail::max_addr(), int vmflag = VM_INSTANTFIT)
+    {
+        return vmem_xalloc(get(), detail::round_size(get(), size), align, phase, 0, minaddr, maxaddr, vmflag);
+    }
+
+    void xfree(void *addr, size_t size)
+    {
+        vmem_xfree(get(), addr, detail::round_size(get(), size));
+    }
+
+    /* Allocates room for `count` objects of type T, returns an empty handle on failure */
+    template <typename T>
+    allocation<T> allocate(size_t count = 1, int vmflag = VM_INSTANTFIT)
+    {
+        size_t size = detail::round_size(get(), sizeof(T) * count);
+        T *ptr = static_cast<T *>(vmem_alloc(get(), size, vmflag));
+
+        return allocation<T>(get(), ptr, ptr != nullptr ? size : 0);
+    }
+
+private:
+    void destroy() noexcept
+    {
+        if (vmp_)
+            vmem_destroy(vmp_.get());
+
+        vmp_.reset();
+    }
+
+    std::unique_ptr<Vmem> vmp_;
+};
+
+/* Adapter letting pmr containers allocate straight from an arena.
+   The alignment asked by do_allocate() is forwarded as the vmem_xalloc() alignment when it exceeds the quantum. */
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+    explicit memory_resource(Vmem *vmp, int vmflag = VM_INSTANTFIT) noexcept
+        : vmp_(vmp), vmflag_(vmflag)
+    {
+    }
+
+    explicit memory_resource(arena &a, int vmflag = VM_INSTANTFIT) noexcept
+        : memory_resource(a.get(), vmflag)
+    {
+    }
+
+    Vmem *get() const noexcept
+    {
+        return vmp_;
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        void *ptr = vmem_xalloc(vmp_, detail::round_size(vmp_, bytes), alignment > vmp_->quantum ? alignment : 0, 0, 0, nullptr, detail::max_addr(), vmflag_);
+
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, size_t bytes, size_t) override
+    {
+        vmem_xfree(vmp_, ptr, detail::round_size(vmp_, bytes));
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const memory_resource *res = dynamic_cast<const memory_resource *>(&other);
+        return res != nullptr && res->vmp_ == vmp_;
+    }
+
+private:
+    Vmem *vmp_;
+    int vmflag_;
+};
+
+/* Monotonic sub-arena, in the spirit of std::pmr::monotonic_buffer_resource: chunks are imported from a parent arena
+   and carved with a bump pointer, deallocation is a no-op, and every chunk goes back to the parent in release() or on destruction.
+   Chunk headers are stored in the chunks themselves, so the parent must manage memory. */
+class monotonic_arena : public std::pmr::memory_resource
+{
+public:
+    explicit monotonic_arena(Vmem *parent, size_t chunk_size = 0, int vmflag = VM_INSTANTFIT) noexcept
+        : parent_(parent), next_size_(chunk_size != 0 ? chunk_size : parent->quantum * 16), vmflag_(vmflag)
+    {
+    }
+
+    explicit monotonic_arena(arena &parent, size_t chunk_size = 0, int vmflag = VM_INSTANTFIT) noexcept
+        : monotonic_arena(parent.get(), chunk_size, vmflag)
+    {
+    }
+
+    monotonic_arena(const monotonic_arena &) = delete;
+    monotonic_arena &operator=(const monotonic_arena &) = delete;
+
+    ~monotonic_arena()
+    {
+        release();
+    }
+
+    /* Gives every chunk back to the parent arena */
+    void release() noexcept
+    {
+        while (chunks_ != nullptr)
+        {
+            chunk *c = chunks_;
+            chunks_ = c->next;
+            vmem_xfree(parent_, c, c->size);
+        }
+
+        cur_ = end_ = 0;
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        uintptr_t ptr = align_up(cur_, alignment);
+
+        if (chunks_ == nullptr || ptr + bytes > end_)
+        {
+            grow(sizeof(chunk) + alignment + bytes);
+            ptr = align_up(cur_, alignment);
+        }
+
+        cur_ = ptr + bytes;
+
+        return reinterpret_cast<void *>(ptr);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    struct chunk
+    {
+        chunk *next;
+        size_t size;
+    };
+
+    static uintptr_t align_up(uintptr_t addr, size_t align) noexcept
+    {
+        return (addr + align - 1) & ~static_cast<uintptr_t>(align - 1);
+    }
+
+    /* Imports a new chunk of at least `min_size` bytes, chunk sizes grow geometrically like the standard's monotonic resource */
+    void grow(size_t min_size)
+    {
+        size_t size = detail::round_size(parent_, next_size_ > min_size ? next_size_ : min_size);
+        void *mem = vmem_xalloc(parent_, size, 0, 0, 0, nullptr, detail::max_addr(), vmflag_);
+
+        if (mem == nullptr)
+            throw std::bad_alloc();
+
+        chunks_ = new (mem) chunk{chunks_, size};
+        cur_ = reinterpret_cast<uintptr_t>(chunks_ + 1);
+        end_ = reinterpret_cast<uintptr_t>(mem) + size;
+        next_size_ = size * 2;
+    }
+
+    Vmem *parent_;
+    size_t next_size_;
+    int vmflag_;
+    chunk *chunks_ = nullptr;
+    uintptr_t cur_ = 0;
+    uintptr_t end_ = 0;
+};
+
+} // namespace tinyvmem
+
+#endif